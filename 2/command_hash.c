@@ -0,0 +1,229 @@
+#include "command_hash.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+struct command_hash_entry {
+	/** Command name, NULL if the slot is free. */
+	char *name;
+	/** Absolute path to the executable. */
+	char *path;
+	/** How many times the path was taken from the cache. */
+	uint32_t hits;
+};
+
+struct command_hash {
+	/** Open addressing table with linear probing. */
+	struct command_hash_entry *entries;
+	/** Always a power of 2 or 0. */
+	uint32_t capacity;
+	uint32_t count;
+	/** PATH value the entries were resolved with. */
+	char *path_env;
+	/** Last found path which is relative, hence not cached. */
+	char *uncached;
+};
+
+static uint32_t
+command_hash_str(const char *str)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *str != 0; ++str) {
+		h ^= (unsigned char)*str;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+struct command_hash *
+command_hash_new(void)
+{
+	return calloc(1, sizeof(struct command_hash));
+}
+
+void
+command_hash_clear(struct command_hash *h)
+{
+	for (uint32_t i = 0; i < h->capacity; ++i) {
+		struct command_hash_entry *e = &h->entries[i];
+		if (e->name == NULL)
+			continue;
+		free(e->name);
+		free(e->path);
+		e->name = NULL;
+		e->path = NULL;
+	}
+	h->count = 0;
+	free(h->path_env);
+	h->path_env = NULL;
+}
+
+void
+command_hash_delete(struct command_hash *h)
+{
+	command_hash_clear(h);
+	free(h->entries);
+	free(h->uncached);
+	free(h);
+}
+
+static struct command_hash_entry *
+command_hash_find_slot(const struct command_hash *h, const char *name)
+{
+	assert(h->capacity > 0);
+	uint32_t mask = h->capacity - 1;
+	uint32_t i = command_hash_str(name) & mask;
+	while (h->entries[i].name != NULL &&
+	       strcmp(h->entries[i].name, name) != 0)
+		i = (i + 1) & mask;
+	return &h->entries[i];
+}
+
+static void
+command_hash_grow(struct command_hash *h)
+{
+	struct command_hash_entry *old = h->entries;
+	uint32_t old_capacity = h->capacity;
+	h->capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+	h->entries = calloc(h->capacity, sizeof(*h->entries));
+	for (uint32_t i = 0; i < old_capacity; ++i) {
+		if (old[i].name != NULL)
+			*command_hash_find_slot(h, old[i].name) = old[i];
+	}
+	free(old);
+}
+
+/**
+ * Delete an entry keeping the probe chains valid. The following
+ * entries of the same cluster are shifted back to fill the hole.
+ */
+static void
+command_hash_remove(struct command_hash *h, struct command_hash_entry *e)
+{
+	uint32_t mask = h->capacity - 1;
+	uint32_t hole = e - h->entries;
+	free(e->name);
+	free(e->path);
+	e->name = NULL;
+	e->path = NULL;
+	--h->count;
+	for (uint32_t i = (hole + 1) & mask; h->entries[i].name != NULL;
+	     i = (i + 1) & mask) {
+		uint32_t home = command_hash_str(h->entries[i].name) & mask;
+		/* Can move only if the hole is between home and i. */
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+		h->entries[hole] = h->entries[i];
+		h->entries[i].name = NULL;
+		h->entries[i].path = NULL;
+		hole = i;
+	}
+}
+
+static bool
+is_executable(const char *path)
+{
+	struct stat st;
+	return access(path, X_OK) == 0 && stat(path, &st) == 0 &&
+	       S_ISREG(st.st_mode);
+}
+
+/** Search the command in PATH the same way as execvp() does. */
+static char *
+command_hash_resolve(const char *name, const char *path_env)
+{
+	size_t name_len = strlen(name);
+	const char *dir = path_env;
+	while (true) {
+		const char *dir_end = strchr(dir, ':');
+		if (dir_end == NULL)
+			dir_end = dir + strlen(dir);
+		size_t dir_len = dir_end - dir;
+		char *path = malloc(dir_len + name_len + 3);
+		if (dir_len == 0) {
+			/* Empty entry means the current directory. */
+			path[0] = '.';
+			dir_len = 1;
+		} else {
+			memcpy(path, dir, dir_len);
+		}
+		path[dir_len] = '/';
+		memcpy(path + dir_len + 1, name, name_len + 1);
+		if (is_executable(path))
+			return path;
+		free(path);
+		if (*dir_end == 0)
+			return NULL;
+		dir = dir_end + 1;
+	}
+}
+
+const char *
+command_hash_lookup(struct command_hash *h, const char *name)
+{
+	if (strchr(name, '/') != NULL)
+		return name;
+	const char *path_env = getenv("PATH");
+	if (path_env == NULL)
+		path_env = "/bin:/usr/bin";
+	if (h->path_env != NULL && strcmp(h->path_env, path_env) != 0)
+		command_hash_clear(h);
+	if (h->path_env == NULL)
+		h->path_env = strdup(path_env);
+
+	struct command_hash_entry *e = NULL;
+	if (h->count > 0) {
+		e = command_hash_find_slot(h, name);
+		if (e->name != NULL) {
+			/* The file could be deleted since it was found. */
+			if (access(e->path, X_OK) == 0) {
+				++e->hits;
+				return e->path;
+			}
+			command_hash_remove(h, e);
+		}
+	}
+	char *path = command_hash_resolve(name, path_env);
+	if (path == NULL)
+		return NULL;
+	/*
+	 * Paths relative to the current directory become invalid after
+	 * 'cd'. Such commands are found but never remembered.
+	 */
+	if (path[0] != '/') {
+		free(h->uncached);
+		h->uncached = path;
+		return path;
+	}
+	if ((h->count + 1) * 4 > h->capacity * 3)
+		command_hash_grow(h);
+	e = command_hash_find_slot(h, name);
+	assert(e->name == NULL);
+	e->name = strdup(name);
+	e->path = path;
+	e->hits = 1;
+	++h->count;
+	return path;
+}
+
+void
+command_hash_print(const struct command_hash *h, int fd)
+{
+	if (h->count == 0) {
+		dprintf(fd, "hash: hash table empty\n");
+		return;
+	}
+	dprintf(fd, "hits\tcommand\n");
+	for (uint32_t i = 0; i < h->capacity; ++i) {
+		const struct command_hash_entry *e = &h->entries[i];
+		if (e->name != NULL)
+			dprintf(fd, "%4u\t%s\n", e->hits, e->path);
+	}
+}
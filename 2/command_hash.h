@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Cache of resolved executable paths, like the 'hash' builtin of
+ * bash. A command name without slashes is searched in PATH only
+ * once, then its absolute path is taken from the cache. The cache
+ * is flushed when PATH changes, and a single entry is dropped when
+ * its binary is not executable anymore.
+ */
+struct command_hash;
+
+struct command_hash *
+command_hash_new(void);
+
+/**
+ * Find an executable file for the command @a name.
+ * @retval not NULL Path to execute. Owned by the hash, valid until
+ *     the next call of any command_hash function.
+ * @retval NULL Command is not found.
+ */
+const char *
+command_hash_lookup(struct command_hash *h, const char *name);
+
+/** Forget all the remembered paths. */
+void
+command_hash_clear(struct command_hash *h);
+
+/** Print the remembered commands in the format of bash 'hash'. */
+void
+command_hash_print(const struct command_hash *h, int fd);
+
+void
+command_hash_delete(struct command_hash *h);
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE
+
+#include "fd_copy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+enum {
+	/** Buffer of the read() and write() fallback. */
+	FD_COPY_BUF_SIZE = 128 * 1024,
+	/**
+	 * Bytes to ask from splice() and tee() at once. They never move
+	 * more than a pipe can hold anyway.
+	 */
+	FD_COPY_SPLICE_SIZE = 1024 * 1024,
+	FD_COPY_FILE_SIZE = 1024 * 1024 * 1024,
+};
+
+static bool
+fd_is_pipe(int fd)
+{
+	struct stat st;
+	return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/**
+ * Regular file with some data. Files of /proc and /sys report zero
+ * size and are not always supported by the kernel copying, they are
+ * read the usual way.
+ */
+static bool
+fd_is_file(int fd)
+{
+	struct stat st;
+	return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+}
+
+/**
+ * splice() and copy_file_range() refuse to write to a file opened with
+ * O_APPEND, it is checked beforehand.
+ */
+static bool
+fd_is_append(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	return flags >= 0 && (flags & O_APPEND) != 0;
+}
+
+/**
+ * Error of the in-kernel copying, which means it is not supported for
+ * these descriptors, and nothing was moved. Other errors, like EBADF,
+ * are real and are not hidden by falling back to read() and write().
+ */
+static bool
+fd_is_unsupported(int err)
+{
+	return err == EINVAL || err == ENOSYS || err == EXDEV;
+}
+
+static int
+fd_write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/**
+ * Read up to @a size bytes from @a in and write them to @a out and to
+ * the files. @a size 0 means to do that until EOF.
+ * @retval 0 Success.
+ * @retval -1 Error of @a in or @a out.
+ */
+static int
+fd_copy_rw(int in, int out, int *files, int file_count, size_t size)
+{
+	char buf[FD_COPY_BUF_SIZE];
+	bool is_limited = size > 0;
+	while (!is_limited || size > 0) {
+		size_t len = sizeof(buf);
+		if (is_limited && len > size)
+			len = size;
+		ssize_t rc = read(in, buf, len);
+		if (rc == 0)
+			return 0;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (out >= 0 && fd_write_all(out, buf, rc) != 0)
+			return -1;
+		for (int i = 0; i < file_count; ++i) {
+			if (files[i] >= 0 &&
+			    fd_write_all(files[i], buf, rc) != 0)
+				files[i] = -1;
+		}
+		if (is_limited)
+			size -= rc;
+	}
+	return 0;
+}
+
+int
+fd_copy(int in, int out)
+{
+	/* The output file can be empty, only the input must have data. */
+	bool is_append = fd_is_append(out);
+	bool use_file_copy = fd_is_file(in) && !fd_is_pipe(out) && !is_append;
+	bool use_splice = (fd_is_pipe(in) || fd_is_pipe(out)) && !is_append;
+	while (use_file_copy || use_splice) {
+		ssize_t rc;
+		if (use_file_copy) {
+			rc = copy_file_range(in, NULL, out, NULL,
+					     FD_COPY_FILE_SIZE, 0);
+		} else {
+			rc = splice(in, NULL, out, NULL, FD_COPY_SPLICE_SIZE,
+				    SPLICE_F_MOVE);
+		}
+		if (rc > 0)
+			continue;
+		if (rc == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		if (!fd_is_unsupported(errno))
+			return -1;
+		/* Try the next way from the current file positions. */
+		if (use_file_copy)
+			use_file_copy = false;
+		else
+			use_splice = false;
+	}
+	return fd_copy_rw(in, out, NULL, 0, 0);
+}
+
+int
+fd_tee(int in, int out, int *files, int file_count)
+{
+	if (file_count == 0)
+		return fd_copy(in, out);
+	if (file_count > 1 || !fd_is_pipe(in) || !fd_is_pipe(out))
+		return fd_copy_rw(in, out, files, file_count, 0);
+	/*
+	 * The pipe data is duplicated into the output pipe, and then the
+	 * same bytes are moved into the file.
+	 */
+	bool use_splice = !fd_is_append(files[0]);
+	while (true) {
+		ssize_t size = tee(in, out, FD_COPY_SPLICE_SIZE, 0);
+		if (size == 0)
+			return 0;
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+			if (fd_is_unsupported(errno))
+				return fd_copy_rw(in, out, files, file_count, 0);
+			return -1;
+		}
+		while (size > 0) {
+			ssize_t rc = -1;
+			if (use_splice && files[0] >= 0) {
+				rc = splice(in, NULL, files[0], NULL, size,
+					    SPLICE_F_MOVE);
+			}
+			if (rc > 0) {
+				size -= rc;
+				continue;
+			}
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc < 0 && use_splice && files[0] >= 0) {
+				if (fd_is_unsupported(errno))
+					use_splice = false;
+				else
+					files[0] = -1;
+			}
+			/*
+			 * The file doesn't take spliced data or failed. The
+			 * teed bytes still have to be consumed from the input.
+			 */
+			if (fd_copy_rw(in, -1, files, 1, size) != 0)
+				return -1;
+			size = 0;
+		}
+	}
+}
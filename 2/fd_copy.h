@@ -0,0 +1,27 @@
+#pragma once
+
+/**
+ * Moving data between descriptors inside the kernel when it is
+ * possible: splice() when one of the ends is a pipe, copy_file_range()
+ * between regular files and tee() to duplicate a pipe. Other cases,
+ * like a terminal or a file opened for append, fall back to read() and
+ * write().
+ */
+
+/**
+ * Copy everything from @a in to @a out until EOF.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+fd_copy(int in, int out);
+
+/**
+ * Copy everything from @a in to @a out and to each of @a files, like
+ * the 'tee' utility. A file which failed to be written is replaced with
+ * -1 in @a files, the others are still written.
+ * @retval 0 Success. Some of the files could fail.
+ * @retval -1 Reading @a in or writing @a out failed, errno is set.
+ */
+int
+fd_tee(int in, int out, int *files, int file_count);
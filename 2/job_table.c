@@ -0,0 +1,179 @@
+#include "job_table.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/** Set by the signal handler, reset by the reaper. */
+static volatile sig_atomic_t job_table_sigchld = 0;
+
+static void
+job_table_on_sigchld(int signo)
+{
+	(void)signo;
+	job_table_sigchld = 1;
+}
+
+struct job_table {
+	/**
+	 * Open addressing table of job pids with linear probing. Free
+	 * slots are 0.
+	 */
+	pid_t *pids;
+	/** Always a power of 2 or 0. */
+	uint32_t capacity;
+	uint32_t count;
+};
+
+static uint32_t
+job_table_hash(pid_t pid)
+{
+	/*
+	 * Multiplication by an odd constant. The low bits of the result
+	 * used as the slot depend only on the low bits of the pid.
+	 */
+	return (uint32_t)pid * 2654435761u;
+}
+
+struct job_table *
+job_table_new(void)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = job_table_on_sigchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	return calloc(1, sizeof(struct job_table));
+}
+
+void
+job_table_delete(struct job_table *t)
+{
+	free(t->pids);
+	free(t);
+}
+
+static uint32_t
+job_table_find_slot(const struct job_table *t, pid_t pid)
+{
+	assert(t->capacity > 0);
+	uint32_t mask = t->capacity - 1;
+	uint32_t i = job_table_hash(pid) & mask;
+	while (t->pids[i] != 0 && t->pids[i] != pid)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static void
+job_table_grow(struct job_table *t)
+{
+	pid_t *old = t->pids;
+	uint32_t old_capacity = t->capacity;
+	t->capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+	t->pids = calloc(t->capacity, sizeof(*t->pids));
+	for (uint32_t i = 0; i < old_capacity; ++i) {
+		if (old[i] != 0)
+			t->pids[job_table_find_slot(t, old[i])] = old[i];
+	}
+	free(old);
+}
+
+void
+job_table_add(struct job_table *t, pid_t pid)
+{
+	assert(pid > 0);
+	if ((t->count + 1) * 4 > t->capacity * 3)
+		job_table_grow(t);
+	uint32_t i = job_table_find_slot(t, pid);
+	assert(t->pids[i] == 0);
+	t->pids[i] = pid;
+	++t->count;
+}
+
+bool
+job_table_remove(struct job_table *t, pid_t pid)
+{
+	if (t->count == 0)
+		return false;
+	uint32_t mask = t->capacity - 1;
+	uint32_t hole = job_table_find_slot(t, pid);
+	if (t->pids[hole] == 0)
+		return false;
+	t->pids[hole] = 0;
+	--t->count;
+	/* Shift the rest of the cluster back to keep the probe chains. */
+	for (uint32_t i = (hole + 1) & mask; t->pids[i] != 0;
+	     i = (i + 1) & mask) {
+		uint32_t home = job_table_hash(t->pids[i]) & mask;
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+		t->pids[hole] = t->pids[i];
+		t->pids[i] = 0;
+		hole = i;
+	}
+	return true;
+}
+
+uint32_t
+job_table_size(const struct job_table *t)
+{
+	return t->count;
+}
+
+void
+job_table_clear(struct job_table *t)
+{
+	if (t->capacity > 0)
+		memset(t->pids, 0, sizeof(*t->pids) * t->capacity);
+	t->count = 0;
+}
+
+void
+job_table_reap(struct job_table *t)
+{
+	if (!job_table_sigchld)
+		return;
+	/*
+	 * Reset before reaping. A signal coming during the loop either
+	 * is handled by it or stays for the next reap.
+	 */
+	job_table_sigchld = 0;
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		job_table_remove(t, pid);
+}
+
+void
+job_table_wait_all(struct job_table *t)
+{
+	while (t->count > 0) {
+		pid_t pid = waitpid(-1, NULL, 0);
+		if (pid > 0) {
+			job_table_remove(t, pid);
+		} else if (errno != EINTR) {
+			job_table_clear(t);
+			return;
+		}
+	}
+}
+
+pid_t
+job_table_wait_foreground(struct job_table *t, int *status,
+			  struct rusage *usage)
+{
+	while (true) {
+		pid_t pid = wait4(-1, status, 0, usage);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!job_table_remove(t, pid))
+			return pid;
+	}
+}
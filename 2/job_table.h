@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct rusage;
+
+/**
+ * Background jobs of the shell, indexed by pid. Finished jobs are
+ * reaped only after SIGCHLD was delivered, so the foreground commands
+ * don't pay for polling each of the running jobs.
+ */
+struct job_table;
+
+struct job_table *
+job_table_new(void);
+
+void
+job_table_delete(struct job_table *t);
+
+void
+job_table_add(struct job_table *t, pid_t pid);
+
+/**
+ * Forget a job which has finished.
+ * @retval true The pid was a job.
+ * @retval false The pid is not known.
+ */
+bool
+job_table_remove(struct job_table *t, pid_t pid);
+
+uint32_t
+job_table_size(const struct job_table *t);
+
+/** Forget all the jobs. For example, in a forked subshell. */
+void
+job_table_clear(struct job_table *t);
+
+/**
+ * Remove the finished jobs without blocking. It is a no-op unless
+ * SIGCHLD came since the previous reap. Must be called only when the
+ * shell doesn't have foreground children to wait for.
+ */
+void
+job_table_reap(struct job_table *t);
+
+/** Block until all the jobs are finished. */
+void
+job_table_wait_all(struct job_table *t);
+
+/**
+ * Wait for any child. A finished job is removed from the table and
+ * waiting continues, so only a foreground child pid is returned.
+ * @param usage Resources used by the child, can be NULL.
+ * @retval > 0 Pid of a foreground child, its status is in @a status.
+ * @retval -1 No children to wait for.
+ */
+pid_t
+job_table_wait_foreground(struct job_table *t, int *status,
+			  struct rusage *usage);
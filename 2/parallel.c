@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+
+#include "parallel.h"
+#include "command_hash.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct parallel_slot {
+	/** -1 when the slot is free. */
+	pid_t pid;
+	/** Becomes readable when the process exits. -1 if not supported. */
+	int pidfd;
+	/** Read ends of stdout and stderr pipes, -1 when closed. */
+	int fds[2];
+	/** Collected stdout and stderr of the process. */
+	char *data[2];
+	size_t size[2];
+	size_t capacity[2];
+	int status;
+	bool is_exited;
+};
+
+enum {
+	PARALLEL_EVENT_STDOUT = 0,
+	PARALLEL_EVENT_STDERR = 1,
+	PARALLEL_EVENT_EXIT = 2,
+};
+
+static int
+parallel_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void)pid;
+	return -1;
+#endif
+}
+
+static void
+parallel_write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		data += rc;
+		size -= rc;
+	}
+}
+
+/**
+ * Start the command in a free slot.
+ * @retval 0 Success.
+ * @retval -1 The command can't be started, the error is printed and
+ *         the slot stays free.
+ */
+static int
+parallel_slot_start(struct parallel_slot *slot, int slot_id, int epfd,
+		    const char *path, char **argv, struct command_hash *hash,
+		    parallel_exec_f exec)
+{
+	int out[2], err[2];
+	if (pipe2(out, O_CLOEXEC) != 0) {
+		perror("parallel: pipe");
+		return -1;
+	}
+	if (pipe2(err, O_CLOEXEC) != 0) {
+		perror("parallel: pipe");
+		close(out[0]);
+		close(out[1]);
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("parallel: fork");
+		close(out[0]);
+		close(out[1]);
+		close(err[0]);
+		close(err[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_RDONLY);
+		dup2(null_fd, STDIN_FILENO);
+		close(null_fd);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(err[1], STDERR_FILENO);
+		exec(path, argv, hash);
+	}
+	slot->pid = pid;
+	close(out[1]);
+	close(err[1]);
+	slot->fds[0] = out[0];
+	slot->fds[1] = err[0];
+	slot->size[0] = slot->size[1] = 0;
+	slot->is_exited = false;
+	slot->pidfd = parallel_pidfd_open(slot->pid);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	for (int i = 0; i < 2; ++i) {
+		ev.data.u32 = slot_id * 4 + i;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, slot->fds[i], &ev);
+	}
+	if (slot->pidfd >= 0) {
+		ev.data.u32 = slot_id * 4 + PARALLEL_EVENT_EXIT;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, slot->pidfd, &ev);
+	}
+	return 0;
+}
+
+/**
+ * Close a descriptor watched by epoll. Children started meanwhile can
+ * still share it until they call exec, and then closing alone wouldn't
+ * remove it from epoll.
+ */
+static void
+parallel_close(int epfd, int fd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+}
+
+/** Read what is available in a pipe of the slot, close it on EOF. */
+static void
+parallel_slot_read(struct parallel_slot *slot, int i, int epfd)
+{
+	if (slot->capacity[i] - slot->size[i] < 4096) {
+		slot->capacity[i] = slot->capacity[i] * 2 + 4096;
+		slot->data[i] = realloc(slot->data[i], slot->capacity[i]);
+	}
+	ssize_t rc = read(slot->fds[i], slot->data[i] + slot->size[i],
+			  slot->capacity[i] - slot->size[i]);
+	if (rc > 0) {
+		slot->size[i] += rc;
+	} else if (rc == 0 || errno != EINTR) {
+		parallel_close(epfd, slot->fds[i]);
+		slot->fds[i] = -1;
+	}
+}
+
+static bool
+parallel_slot_is_done(struct parallel_slot *slot)
+{
+	assert(slot->pid > 0);
+	if (slot->fds[0] >= 0 || slot->fds[1] >= 0)
+		return false;
+	if (!slot->is_exited) {
+		if (slot->pidfd >= 0)
+			return false;
+		/* No pidfd, but both pipes are closed so it is about to end. */
+		waitpid(slot->pid, &slot->status, 0);
+		slot->is_exited = true;
+	}
+	return true;
+}
+
+/**
+ * Build an argument with each '{}' in @a arg replaced by @a value.
+ * @retval NULL There is nothing to replace.
+ * @retval not NULL New string to free.
+ */
+static char *
+parallel_substitute(const char *arg, const char *value)
+{
+	const char *pos = strstr(arg, "{}");
+	if (pos == NULL)
+		return NULL;
+	size_t value_len = strlen(value);
+	size_t size = strlen(arg) + 1;
+	for (; pos != NULL; pos = strstr(pos + 2, "{}"))
+		size += value_len;
+	char *res = malloc(size);
+	char *out = res;
+	while ((pos = strstr(arg, "{}")) != NULL) {
+		memcpy(out, arg, pos - arg);
+		out += pos - arg;
+		memcpy(out, value, value_len);
+		out += value_len;
+		arg = pos + 2;
+	}
+	strcpy(out, arg);
+	return res;
+}
+
+int
+parallel_run(char **args, struct command_hash *hash, parallel_exec_f exec)
+{
+	long slot_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (args[0] != NULL && strncmp(args[0], "-j", 2) == 0) {
+		if (args[0][2] != 0) {
+			slot_count = atol(args[0] + 2);
+			++args;
+		} else if (args[1] != NULL) {
+			slot_count = atol(args[1]);
+			args += 2;
+		} else {
+			slot_count = 0;
+		}
+	}
+	int cmd_argc = 0;
+	while (args[cmd_argc] != NULL && strcmp(args[cmd_argc], ":::") != 0)
+		++cmd_argc;
+	if (slot_count <= 0 || cmd_argc == 0 || args[cmd_argc] == NULL) {
+		fprintf(stderr, "usage: parallel [-j N] command [args...] "
+			"::: value...\n");
+		return 255;
+	}
+	char **values = &args[cmd_argc + 1];
+	int value_count = 0;
+	while (values[value_count] != NULL)
+		++value_count;
+	if (slot_count > value_count)
+		slot_count = value_count;
+	if (value_count == 0)
+		return 0;
+
+	bool has_placeholder = false;
+	for (int i = 0; i < cmd_argc; ++i)
+		has_placeholder = has_placeholder || strstr(args[i], "{}") != NULL;
+	char **argv = malloc((cmd_argc + 2) * sizeof(char *));
+
+	struct parallel_slot *slots = calloc(slot_count, sizeof(*slots));
+	struct epoll_event *events = malloc(slot_count * 3 * sizeof(*events));
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("parallel: epoll");
+		free(slots);
+		free(events);
+		free(argv);
+		return 255;
+	}
+	int next_value = 0, running = 0, failed = 0;
+	for (int i = 0; i < slot_count; ++i)
+		slots[i].pid = -1;
+	while (next_value < value_count || running > 0) {
+		for (int i = 0; i < slot_count && next_value < value_count; ++i) {
+			if (slots[i].pid >= 0)
+				continue;
+			const char *value = values[next_value++];
+			for (int j = 0; j < cmd_argc; ++j) {
+				argv[j] = parallel_substitute(args[j], value);
+				if (argv[j] == NULL)
+					argv[j] = args[j];
+			}
+			argv[cmd_argc] = has_placeholder ? NULL : (char *)value;
+			argv[cmd_argc + 1] = NULL;
+			/*
+			 * The command name can have '{}' too. The lookups of
+			 * the same name after the first are taken from the hash.
+			 */
+			const char *path = command_hash_lookup(hash, argv[0]);
+			int rc = parallel_slot_start(&slots[i], i, epfd, path,
+						     argv, hash, exec);
+			for (int j = 0; j < cmd_argc; ++j) {
+				if (argv[j] != args[j])
+					free(argv[j]);
+			}
+			if (rc == 0)
+				++running;
+			else
+				++failed;
+		}
+		if (running == 0)
+			continue;
+		int count = epoll_wait(epfd, events, slot_count * 3, -1);
+		for (int k = 0; k < count; ++k) {
+			struct parallel_slot *slot = &slots[events[k].data.u32 / 4];
+			int what = events[k].data.u32 % 4;
+			if (what == PARALLEL_EVENT_EXIT) {
+				if (slot->pidfd < 0)
+					continue;
+				if (waitpid(slot->pid, &slot->status, WNOHANG) != slot->pid)
+					continue;
+				slot->is_exited = true;
+				parallel_close(epfd, slot->pidfd);
+				slot->pidfd = -1;
+			} else if (slot->fds[what] >= 0) {
+				parallel_slot_read(slot, what, epfd);
+			}
+		}
+		for (int i = 0; i < slot_count; ++i) {
+			struct parallel_slot *slot = &slots[i];
+			if (slot->pid < 0 || !parallel_slot_is_done(slot))
+				continue;
+			parallel_write_all(STDOUT_FILENO, slot->data[0], slot->size[0]);
+			parallel_write_all(STDERR_FILENO, slot->data[1], slot->size[1]);
+			if (!WIFEXITED(slot->status) || WEXITSTATUS(slot->status) != 0)
+				++failed;
+			slot->pid = -1;
+			--running;
+		}
+	}
+	close(epfd);
+	for (int i = 0; i < slot_count; ++i) {
+		free(slots[i].data[0]);
+		free(slots[i].data[1]);
+	}
+	free(slots);
+	free(events);
+	free(argv);
+	return failed > 101 ? 101 : failed;
+}
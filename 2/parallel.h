@@ -0,0 +1,27 @@
+#pragma once
+
+struct command_hash;
+
+/**
+ * Replace the current child process with a command. Must not return.
+ * @param path Path of the command found by the shell, NULL if none.
+ */
+typedef void
+(*parallel_exec_f)(const char *path, char **argv, struct command_hash *hash);
+
+/**
+ * Builtin 'parallel [-j N] command [args...] ::: value...'. The command
+ * is run once per each value, which replaces each '{}' in the
+ * arguments or is appended if there are none. At most N commands run
+ * at once, one per CPU by default. A new one is started as soon as any
+ * of the running ones finishes. Output of each command is collected
+ * and printed when it is finished, so outputs of different commands
+ * never interleave.
+ *
+ * @param args Arguments after the builtin name, NULL terminated.
+ * @param exec Runs a command in a forked child.
+ * @return The number of failed commands, like GNU parallel does.
+ *         A command which could not be started counts as failed.
+ */
+int
+parallel_run(char **args, struct command_hash *hash, parallel_exec_f exec);
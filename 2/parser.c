@@ -5,11 +5,11 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
-};
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 enum token_type {
 	TOKEN_TYPE_NONE,
@@ -21,51 +21,238 @@ enum token_type {
 	TOKEN_TYPE_OUT_NEW,
 	TOKEN_TYPE_OUT_APPEND,
 	TOKEN_TYPE_BACKGROUND,
+	TOKEN_TYPE_IN_FILE,
+	TOKEN_TYPE_IN_STRING,
+	TOKEN_TYPE_ERR_NEW,
+	TOKEN_TYPE_ERR_APPEND,
+	/** '2>&', has to be followed by '1'. */
+	TOKEN_TYPE_ERR_DUP,
+	TOKEN_TYPE_GROUP_OPEN,
+	TOKEN_TYPE_GROUP_CLOSE,
+};
+
+enum {
+	/** Minimal size of a command line memory chunk. */
+	ARENA_CHUNK_SIZE = 1024,
+	ARENA_ALIGN = sizeof(void *),
 };
 
+/**
+ * Memory of a command line is a list of chunks. The line object, its
+ * expressions, strings and arrays are allocated by moving a position
+ * in the newest chunk, and are never freed separately. The whole list
+ * is freed together with the line.
+ */
+struct arena_chunk {
+	/** Previous, fully used chunk. */
+	struct arena_chunk *next;
+	uint32_t size;
+	uint32_t used;
+	char data[];
+};
+
+static struct arena_chunk *
+arena_chunk_new(struct arena_chunk *next, uint32_t need)
+{
+	uint32_t size = ARENA_CHUNK_SIZE;
+	if (next != NULL && next->size * 2 > size)
+		size = next->size * 2;
+	if (size < need)
+		size = need;
+	struct arena_chunk *c = malloc(sizeof(*c) + size);
+	c->next = next;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+static void *
+arena_alloc(struct arena_chunk **arena, uint32_t size)
+{
+	struct arena_chunk *c = *arena;
+	uint32_t used = 0;
+	if (c != NULL)
+		used = (c->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (c == NULL || used > c->size || c->size - used < size) {
+		c = arena_chunk_new(c, size);
+		*arena = c;
+		used = 0;
+	}
+	c->used = used + size;
+	return c->data + used;
+}
+
+/** Free all the memory except the newest chunk, which is kept empty. */
+static void
+arena_reset(struct arena_chunk **arena)
+{
+	struct arena_chunk *c = *arena;
+	if (c == NULL)
+		return;
+	while (c->next != NULL) {
+		struct arena_chunk *next = c->next->next;
+		free(c->next);
+		c->next = next;
+	}
+	c->used = 0;
+}
+
+static void
+arena_delete(struct arena_chunk *arena)
+{
+	while (arena != NULL) {
+		struct arena_chunk *next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
+/**
+ * A token string is built right in the free space of the command line
+ * memory, with quotes and escapes already resolved. If the token turns
+ * out to be an argument, it stays there, otherwise the space is reused
+ * by the next token.
+ */
 struct token {
 	enum token_type type;
+	/** Memory of the line the token belongs to. */
+	struct arena_chunk **arena;
 	char *data;
 	uint32_t size;
-	uint32_t capacity;
+	/**
+	 * State of a token which is not complete yet. It is kept when the
+	 * data ends, and the scan continues from there after a feed.
+	 */
+	/** Open quote or 0. */
+	char quote;
+	/** No quotes or escapes so far, so '2' can start '2>'. */
+	bool is_bare;
+	/** The rest of the line is a comment. */
+	bool is_comment;
 };
 
+/** Make space for @a len more bytes and the terminating zero. */
+static void
+token_reserve(struct token *t, uint32_t len)
+{
+	struct arena_chunk *chunk = *t->arena;
+	if (t->data == NULL) {
+		if (chunk == NULL || chunk->size - chunk->used < len + 1) {
+			chunk = arena_chunk_new(chunk, len + 1);
+			*t->arena = chunk;
+		}
+		t->data = chunk->data + chunk->used;
+	} else if (t->data + t->size + len + 1 > chunk->data + chunk->size) {
+		chunk = arena_chunk_new(chunk, (t->size + len + 1) * 2);
+		memcpy(chunk->data, t->data, t->size);
+		*t->arena = chunk;
+		t->data = chunk->data;
+	}
+}
+
 static char *
-token_strdup(const struct token *t)
+token_commit(struct token *t)
 {
 	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
+	/* Empty quotes give an empty string with no memory yet. */
+	if (t->data == NULL)
+		token_reserve(t, 0);
+	struct arena_chunk *c = *t->arena;
+	assert(t->data + t->size < c->data + c->size);
+	t->data[t->size] = 0;
+	c->used = t->data + t->size + 1 - c->data;
+	return t->data;
 }
 
 static void
 token_append(struct token *t, char c)
 {
-	if (t->size == t->capacity) {
-		t->capacity = (t->capacity + 1) * 2;
-		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
-	} else {
-		assert(t->size < t->capacity);
-	}
+	token_reserve(t, 1);
 	t->data[t->size++] = c;
 }
 
+static void
+token_append_run(struct token *t, const char *str, uint32_t len)
+{
+	token_reserve(t, len);
+	memcpy(t->data + t->size, str, len);
+	t->size += len;
+}
+
 static void
 token_reset(struct token *t)
 {
+	t->data = NULL;
 	t->size = 0;
 	t->type = TOKEN_TYPE_NONE;
+	t->quote = 0;
+	t->is_bare = true;
+	t->is_comment = false;
 }
 
+/** What the parser expects next in the current line. */
+enum parser_state {
+	/** Commands, subshells and operators between them. */
+	PARSER_STATE_EXPRS,
+	/** Target of a redirection. */
+	PARSER_STATE_REDIRECT,
+	/** Name of the output file after '>' or '>>'. */
+	PARSER_STATE_OUT_FILE,
+	/** Redirections, '&' or the line end after the output file. */
+	PARSER_STATE_AFTER_OUT_FILE,
+	/** The line end after '&'. */
+	PARSER_STATE_AFTER_BACKGROUND,
+	/** The line has an error, the rest of it is skipped. */
+	PARSER_STATE_SKIP,
+};
+
+struct parser {
+	/** Own copy of the fed data. */
+	char *buffer;
+	uint32_t capacity;
+	/**
+	 * Data being parsed. It is either the buffer above or an external
+	 * memory given to parser_feed_external().
+	 */
+	const char *data;
+	/** Beginning of not parsed yet data. */
+	uint32_t pos;
+	uint32_t size;
+	/**
+	 * Memory where the next command line is built. It is given away
+	 * to the line when it is returned.
+	 */
+	struct arena_chunk *arena;
+	/**
+	 * The line being parsed, NULL between the lines. It is built
+	 * token by token and survives the ends of the fed data, so each
+	 * byte is scanned once however the data is split.
+	 */
+	struct command_line *line;
+	/** Innermost subshell of the line which is not closed yet. */
+	struct expr *group;
+	struct token token;
+	enum parser_state state;
+	/** Valid in the REDIRECT state. */
+	enum token_type redirect_type;
+	/** State to return to after the redirection target. */
+	enum parser_state redirect_return;
+	/** Valid in the SKIP state, the error to report at the line end. */
+	enum parser_error error;
+};
+
+
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct command *cmd, struct arena_chunk **arena,
+		   char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
 		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		char **args = arena_alloc(arena,
+					  sizeof(*cmd->args) * cmd->arg_capacity);
+		if (cmd->arg_count > 0)
+			memcpy(args, cmd->args, sizeof(*args) * cmd->arg_count);
+		cmd->args = args;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
@@ -75,91 +262,302 @@ command_append_arg(struct command *cmd, char *arg)
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
-	}
-	free(line->out_file);
-	free(line);
+	/* The line object is in this memory too. */
+	arena_delete(line->arena);
+}
+
+static struct expr *
+expr_new(struct arena_chunk **arena, enum expr_type type)
+{
+	struct expr *e = arena_alloc(arena, sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
+}
+
+/** The last expression of the innermost open subshell or of the line. */
+static struct expr *
+command_line_tail(const struct command_line *line, const struct expr *group)
+{
+	return group == NULL ? line->tail : group->body_tail;
 }
 
+/** Append to the innermost open subshell or to the line. */
 static void
-command_line_append(struct command_line *line, struct expr *e)
+command_line_append(struct command_line *line, struct expr *group,
+		    struct expr *e)
 {
-	if (line->head == NULL)
-		line->head = e;
+	struct expr **head = group == NULL ? &line->head : &group->body;
+	struct expr **tail = group == NULL ? &line->tail : &group->body_tail;
+	if (*head == NULL)
+		*head = e;
 	else
-		line->tail->next = e;
-	line->tail = e;
+		(*tail)->next = e;
+	*tail = e;
+}
+
+static bool
+expr_is_operand(const struct expr *e)
+{
+	return e->type == EXPR_TYPE_COMMAND || e->type == EXPR_TYPE_SUBSHELL;
+}
+
+/**
+ * A 'time' word alone starting a pipeline, which can prefix a subshell.
+ * After '|' it is a usual command, like in bash.
+ */
+static bool
+command_line_is_time_prefix(const struct command_line *line,
+			    const struct expr *group, const struct expr *e)
+{
+	if (e->type != EXPR_TYPE_COMMAND || e->cmd.arg_count != 0 ||
+	    e->cmd.redirects != NULL || strcmp(e->cmd.exe, "time") != 0)
+		return false;
+	const struct expr *prev = group == NULL ? line->head : group->body;
+	if (prev == e)
+		return true;
+	while (prev->next != e)
+		prev = prev->next;
+	return prev->type != EXPR_TYPE_PIPE;
 }
 
 struct parser *
 parser_new(void)
 {
-	return calloc(1, sizeof(struct parser));
+	struct parser *p = calloc(1, sizeof(struct parser));
+	p->token.arena = &p->arena;
+	token_reset(&p->token);
+	return p;
 }
 
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
-	uint32_t cap = p->capacity - p->size;
-	if (cap < len) {
-		uint32_t new_capacity = (p->capacity + 1) * 2;
-		if (new_capacity - p->size < len)
-			new_capacity = p->size + len;
-		p->buffer = realloc(p->buffer, sizeof(*p->buffer) * new_capacity);
-		p->capacity = new_capacity;
+	uint32_t rest = p->size - p->pos;
+	if (p->data != p->buffer || p->capacity - p->size < len) {
+		/*
+		 * Move the not parsed tail to the beginning. It is done only
+		 * when the buffer would grow otherwise, so the parsed lines
+		 * are never moved byte by byte after each pop.
+		 */
+		if (p->capacity < rest + len) {
+			uint32_t new_capacity = (p->capacity + 1) * 2;
+			if (new_capacity < rest + len)
+				new_capacity = rest + len;
+			char *buffer = malloc(sizeof(*buffer) * new_capacity);
+			if (rest > 0)
+				memcpy(buffer, p->data + p->pos, rest);
+			free(p->buffer);
+			p->buffer = buffer;
+			p->capacity = new_capacity;
+		} else if (rest > 0) {
+			memmove(p->buffer, p->data + p->pos, rest);
+		}
+		p->data = p->buffer;
+		p->pos = 0;
+		p->size = rest;
 	}
 	memcpy(p->buffer + p->size, str, len);
 	p->size += len;
 	assert(p->size <= p->capacity);
 }
 
+void
+parser_feed_external(struct parser *p, const char *str, uint32_t len)
+{
+	if (p->pos < p->size) {
+		parser_feed(p, str, len);
+		return;
+	}
+	p->data = str;
+	p->pos = 0;
+	p->size = len;
+}
+
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->pos >= size);
+	p->pos += size;
+	if (p->pos == p->size) {
+		p->data = p->buffer;
+		p->pos = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
 }
 
+/** Bits of token_special. */
+enum {
+	/** The symbol has a meaning outside of quotes. */
+	SPECIAL_BARE = 1,
+	/** The symbol has a meaning inside of double quotes. */
+	SPECIAL_DOUBLE_QUOTED = 2,
+	/** The symbol has a meaning inside of single quotes. */
+	SPECIAL_SINGLE_QUOTED = 4,
+};
+
+/** Symbols handled by parse_token(). All the others are just copied. */
+static const uint8_t token_special[256] = {
+	['\t'] = SPECIAL_BARE,
+	['\n'] = SPECIAL_BARE,
+	['\r'] = SPECIAL_BARE,
+	[' '] = SPECIAL_BARE,
+	['#'] = SPECIAL_BARE,
+	['&'] = SPECIAL_BARE,
+	['('] = SPECIAL_BARE,
+	[')'] = SPECIAL_BARE,
+	['<'] = SPECIAL_BARE,
+	['>'] = SPECIAL_BARE,
+	['|'] = SPECIAL_BARE,
+	['"'] = SPECIAL_BARE | SPECIAL_DOUBLE_QUOTED,
+	['\\'] = SPECIAL_BARE | SPECIAL_DOUBLE_QUOTED,
+	['\''] = SPECIAL_BARE | SPECIAL_SINGLE_QUOTED,
+};
+
+#if defined(__SSE2__)
+
+static inline uint32_t
+token_special_mask16(__m128i v, char quote)
+{
+#define EQ(c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+/*
+ * Unsigned v - a < b - a + 1, made signed by the shift by 128. The
+ * ranges also match a few ordinary symbols between the special ones,
+ * like '\v' and '$'. The tokenizer copies them as usual, the scan only
+ * stops there.
+ */
+#define IN_RANGE(a, b) _mm_cmplt_epi8(					\
+	_mm_add_epi8(v, _mm_set1_epi8((char)(128 - (a)))),		\
+	_mm_set1_epi8((char)(128 + (b) - (a) + 1)))
+	__m128i m;
+	if (quote == '\'') {
+		m = EQ('\'');
+	} else if (quote == '"') {
+		m = _mm_or_si128(EQ('"'), EQ('\\'));
+	} else {
+		m = _mm_or_si128(IN_RANGE('\t', '\r'), IN_RANGE(' ', ')'));
+		m = _mm_or_si128(m, _mm_or_si128(EQ('<'), EQ('>')));
+		m = _mm_or_si128(m, _mm_or_si128(EQ('\\'), EQ('|')));
+	}
+#undef IN_RANGE
+#undef EQ
+	return _mm_movemask_epi8(m);
+}
+
+#endif
+
+#if defined(__AVX2__)
+
+static inline uint32_t
+token_special_mask32(__m256i v, char quote)
+{
+#define EQ(c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define IN_RANGE(a, b) _mm256_cmpgt_epi8(				\
+	_mm256_set1_epi8((char)(128 + (b) - (a) + 1)),			\
+	_mm256_add_epi8(v, _mm256_set1_epi8((char)(128 - (a)))))
+	__m256i m;
+	if (quote == '\'') {
+		m = EQ('\'');
+	} else if (quote == '"') {
+		m = _mm256_or_si256(EQ('"'), EQ('\\'));
+	} else {
+		m = _mm256_or_si256(IN_RANGE('\t', '\r'), IN_RANGE(' ', ')'));
+		m = _mm256_or_si256(m, _mm256_or_si256(EQ('<'), EQ('>')));
+		m = _mm256_or_si256(m, _mm256_or_si256(EQ('\\'), EQ('|')));
+	}
+#undef IN_RANGE
+#undef EQ
+	return _mm256_movemask_epi8(m);
+}
+
+#endif
+
+/**
+ * Find the first symbol in [@a pos, @a end) which has to be handled by
+ * the tokenizer when the given quote is open. Everything before it can
+ * be copied into the token as is. The search goes by 32 or 16 bytes at
+ * once when AVX2 or SSE2 are available.
+ */
+static const char *
+token_scan_plain(const char *pos, const char *end, char quote)
+{
+#if defined(__AVX2__)
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)pos);
+		uint32_t mask = token_special_mask32(v, quote);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		uint32_t mask = token_special_mask16(v, quote);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	uint8_t bit;
+	if (quote == '\'')
+		bit = SPECIAL_SINGLE_QUOTED;
+	else if (quote == '"')
+		bit = SPECIAL_DOUBLE_QUOTED;
+	else
+		bit = SPECIAL_BARE;
+	while (pos < end && (token_special[(uint8_t)*pos] & bit) == 0)
+		++pos;
+	return pos;
+}
+
+/** Skip the comment until the line end, which is the token then. */
+static uint32_t
+parse_comment(const char *pos, const char *end, struct token *out)
+{
+	const char *line_end = memchr(pos, '\n', end - pos);
+	if (line_end == NULL)
+		return end - pos;
+	out->is_comment = false;
+	out->type = TOKEN_TYPE_NEW_LINE;
+	return line_end + 1 - pos;
+}
+
+/**
+ * Continue the token @a out from @a pos.
+ * @return Size of the scanned data. The token is complete if its type
+ *     is set. Otherwise all the data is scanned, except a few symbols
+ *     which can't be decided on without the next ones, like '&' which
+ *     can start '&&'. The scan is continued from there after the next
+ *     feed.
+ */
 static uint32_t
 parse_token(const char *pos, const char *end, struct token *out)
 {
-	token_reset(out);
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
+	if (out->is_comment)
+		return parse_comment(pos, end, out);
+	if (out->size == 0 && out->quote == 0) {
+		while (pos < end) {
+			if (!isspace(*pos))
+				break;
+			if (*pos == '\n') {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
+			++pos;
 		}
-		++pos;
 	}
-	char quote = 0;
 	while (pos < end) {
 		char c = *pos;
+		char quote = out->quote;
 		switch(c) {
 		case '\'':
 		case '"':
 			if (quote == 0) {
-				quote = c;
+				out->quote = c;
+				out->is_bare = false;
 				++pos;
-				if (pos == end)
-					return 0;
 				continue;
 			}
 			if (quote != c)
@@ -169,10 +567,10 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '\\':
 			if (quote == '\'')
 				goto append_and_next;
+			if (pos + 1 == end)
+				return pos - begin;
 			if (quote == '"') {
 				++pos;
-				if (pos == end)
-					return 0;
 				c = *pos;
 				switch (c)
 				{
@@ -191,27 +589,79 @@ parse_token(const char *pos, const char *end, struct token *out)
 			}
 			assert(quote == 0);
 			++pos;
-			if (pos == end)
-				return 0;
 			c = *pos;
+			/* The line continues, the token goes on if any. */
 			if (c == '\n') {
 				++pos;
 				continue;
 			}
+			out->is_bare = false;
 			goto append_and_next;
+		case '<':
+			if (quote != 0)
+				goto append_and_next;
+			if (out->size > 0) {
+				out->type = TOKEN_TYPE_STR;
+				return pos - begin;
+			}
+			if (pos + 1 == end)
+				return pos - begin;
+			if (pos[1] != '<') {
+				out->type = TOKEN_TYPE_IN_FILE;
+				return pos + 1 - begin;
+			}
+			if (pos + 2 == end)
+				return pos - begin;
+			/*
+			 * Here-documents are not supported. The second '<' is
+			 * left to fail as a bad file name.
+			 */
+			if (pos[2] != '<') {
+				out->type = TOKEN_TYPE_IN_FILE;
+				return pos + 1 - begin;
+			}
+			out->type = TOKEN_TYPE_IN_STRING;
+			return pos + 3 - begin;
+		case '(':
+		case ')':
+			if (quote != 0)
+				goto append_and_next;
+			if (out->size > 0) {
+				out->type = TOKEN_TYPE_STR;
+				return pos - begin;
+			}
+			if (c == '(')
+				out->type = TOKEN_TYPE_GROUP_OPEN;
+			else
+				out->type = TOKEN_TYPE_GROUP_CLOSE;
+			return pos + 1 - begin;
 		case '&':
 		case '|':
 		case '>':
 			if (quote != 0)
 				goto append_and_next;
+			if (c == '>' && out->is_bare && out->size == 1 &&
+			    out->data[0] == '2') {
+				if (pos + 1 == end)
+					return pos - begin;
+				if (pos[1] == '>') {
+					out->type = TOKEN_TYPE_ERR_APPEND;
+					return pos + 2 - begin;
+				}
+				if (pos[1] == '&') {
+					out->type = TOKEN_TYPE_ERR_DUP;
+					return pos + 2 - begin;
+				}
+				out->type = TOKEN_TYPE_ERR_NEW;
+				return pos + 1 - begin;
+			}
 			if (out->size > 0) {
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
-			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
+			if (pos + 1 == end)
+				return pos - begin;
+			if (pos[1] == c) {
 				switch(c) {
 				case '&':
 					out->type = TOKEN_TYPE_AND;
@@ -226,36 +676,42 @@ parse_token(const char *pos, const char *end, struct token *out)
 					assert(false);
 					break;
 				}
-				++pos;
-			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
-					break;
-				default:
-					assert(false);
-					break;
-				}
+				return pos + 2 - begin;
 			}
-			return pos - begin;
+			switch(c) {
+			case '&':
+				out->type = TOKEN_TYPE_BACKGROUND;
+				break;
+			case '|':
+				out->type = TOKEN_TYPE_PIPE;
+				break;
+			case '>':
+				out->type = TOKEN_TYPE_OUT_NEW;
+				break;
+			default:
+				assert(false);
+				break;
+			}
+			return pos + 1 - begin;
 		case ' ':
 		case '\t':
 		case '\r':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			/* Spaces after a line continuation before a token. */
+			if (out->size == 0) {
+				++pos;
+				continue;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
@@ -265,178 +721,328 @@ parse_token(const char *pos, const char *end, struct token *out)
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
+			out->is_comment = true;
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
-		default:
-			goto append_and_next;
+			return pos - begin + parse_comment(pos, end, out);
+		default: {
+			/* Copy the whole run of ordinary symbols at once. */
+			const char *run_end = token_scan_plain(pos + 1, end, quote);
+			token_append_run(out, pos, run_end - pos);
+			pos = run_end;
+			continue;
+		}
 		}
 	append_and_next:
 		token_append(out, c);
 		++pos;
 	}
-	return 0;
+	return pos - begin;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+static bool
+token_is_redirect(enum token_type type)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
+	return type == TOKEN_TYPE_IN_FILE || type == TOKEN_TYPE_IN_STRING ||
+	       type == TOKEN_TYPE_ERR_NEW || type == TOKEN_TYPE_ERR_APPEND ||
+	       type == TOKEN_TYPE_ERR_DUP;
+}
 
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
-				continue;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
-		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OUT_NEW:
-		case TOKEN_TYPE_OUT_APPEND:
-		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
-		default:
-			assert(false);
-		}
+/**
+ * Attach the redirection of the @a type with the target in @a token to
+ * the command.
+ */
+static enum parser_error
+parser_add_redirect(struct parser *p, enum token_type type,
+		    struct command *cmd)
+{
+	if (p->token.type != TOKEN_TYPE_STR)
+		return PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+	char *target = token_commit(&p->token);
+	if (type == TOKEN_TYPE_ERR_DUP && strcmp(target, "1") != 0)
+		return PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+	struct redirect *r = arena_alloc(&p->arena, sizeof(*r));
+	r->target = target;
+	r->next = NULL;
+	switch (type) {
+	case TOKEN_TYPE_IN_FILE:
+		r->type = REDIRECT_TYPE_FILE_READ;
+		r->fd = 0;
+		break;
+	case TOKEN_TYPE_IN_STRING:
+		r->type = REDIRECT_TYPE_HERE_STRING;
+		r->fd = 0;
+		break;
+	case TOKEN_TYPE_ERR_NEW:
+		r->type = REDIRECT_TYPE_FILE_NEW;
+		r->fd = 2;
+		break;
+	case TOKEN_TYPE_ERR_APPEND:
+		r->type = REDIRECT_TYPE_FILE_APPEND;
+		r->fd = 2;
+		break;
+	case TOKEN_TYPE_ERR_DUP:
+		r->type = REDIRECT_TYPE_STDOUT;
+		r->fd = 2;
+		r->target = NULL;
+		break;
+	default:
+		assert(false);
 	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
+	struct redirect **tail = &cmd->redirects;
+	while (*tail != NULL)
+		tail = &(*tail)->next;
+	*tail = r;
+	return PARSER_ERR_NONE;
+}
+
+/**
+ * Start waiting for the target of the redirection in the token. It
+ * belongs to the last command or subshell of the current level.
+ */
+static enum parser_error
+parser_start_redirect(struct parser *p, struct expr *tail,
+		      enum parser_state next)
+{
+	if (tail == NULL || !expr_is_operand(tail))
+		return PARSER_ERR_REDIRECT_WITH_NO_COMMAND;
+	p->redirect_type = p->token.type;
+	p->redirect_return = next;
+	p->state = PARSER_STATE_REDIRECT;
+	return PARSER_ERR_NONE;
+}
+
+/** Handle a token in the EXPRS state. */
+static enum parser_error
+parser_add_expr(struct parser *p)
+{
+	struct command_line *line = p->line;
+	struct expr *tail = command_line_tail(line, p->group);
+	struct expr *e;
+	char *exe;
+	switch(p->token.type) {
+	case TOKEN_TYPE_STR:
+		if (tail != NULL && tail->type == EXPR_TYPE_COMMAND) {
+			command_append_arg(&tail->cmd, &p->arena,
+					   token_commit(&p->token));
+			return PARSER_ERR_NONE;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+		if (tail != NULL && tail->type == EXPR_TYPE_SUBSHELL)
+			return PARSER_ERR_TOO_LATE_ARGUMENTS;
+		/* Commit first, the expression goes after the string. */
+		exe = token_commit(&p->token);
+		e = expr_new(&p->arena, EXPR_TYPE_COMMAND);
+		e->cmd.exe = exe;
+		command_line_append(line, p->group, e);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_PIPE:
+		if (tail == NULL)
+			return PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
+		if (!expr_is_operand(tail))
+			return PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
+		e = expr_new(&p->arena, EXPR_TYPE_PIPE);
+		command_line_append(line, p->group, e);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_AND:
+		if (tail == NULL)
+			return PARSER_ERR_AND_WITH_NO_LEFT_ARG;
+		if (!expr_is_operand(tail))
+			return PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
+		e = expr_new(&p->arena, EXPR_TYPE_AND);
+		command_line_append(line, p->group, e);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OR:
+		if (tail == NULL)
+			return PARSER_ERR_OR_WITH_NO_LEFT_ARG;
+		if (!expr_is_operand(tail))
+			return PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
+		e = expr_new(&p->arena, EXPR_TYPE_OR);
+		command_line_append(line, p->group, e);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_GROUP_OPEN:
+		if (tail != NULL &&
+		    command_line_is_time_prefix(line, p->group, tail)) {
+			/* The 'time' word turns into the subshell it times. */
+			e = tail;
+			memset(&e->cmd, 0, sizeof(e->cmd));
+			e->type = EXPR_TYPE_SUBSHELL;
+			e->is_timed = true;
+			e->parent = p->group;
+			p->group = e;
+			return PARSER_ERR_NONE;
+		}
+		if (tail != NULL && expr_is_operand(tail))
+			return PARSER_ERR_GROUP_WITH_LEFT_ARG;
+		e = expr_new(&p->arena, EXPR_TYPE_SUBSHELL);
+		e->parent = p->group;
+		command_line_append(line, p->group, e);
+		p->group = e;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_GROUP_CLOSE:
+		if (p->group == NULL)
+			return PARSER_ERR_GROUP_NOT_OPENED;
+		if (tail == NULL || !expr_is_operand(tail))
+			return PARSER_ERR_GROUP_ENDS_NOT_WITH_A_COMMAND;
+		p->group = p->group->parent;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OUT_NEW:
+	case TOKEN_TYPE_OUT_APPEND:
+	case TOKEN_TYPE_BACKGROUND:
+		if (p->group != NULL)
+			return PARSER_ERR_GROUP_NOT_CLOSED;
+		if (tail == NULL && p->token.type == TOKEN_TYPE_BACKGROUND)
+			return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		if (tail == NULL)
+			return PARSER_ERR_REDIRECT_WITH_NO_COMMAND;
+		if (p->token.type == TOKEN_TYPE_BACKGROUND) {
+			line->is_background = true;
+			p->state = PARSER_STATE_AFTER_BACKGROUND;
+		} else {
+			if (p->token.type == TOKEN_TYPE_OUT_NEW)
+				line->out_type = OUTPUT_TYPE_FILE_NEW;
+			else
+				line->out_type = OUTPUT_TYPE_FILE_APPEND;
+			p->state = PARSER_STATE_OUT_FILE;
+		}
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_IN_FILE:
+	case TOKEN_TYPE_IN_STRING:
+	case TOKEN_TYPE_ERR_NEW:
+	case TOKEN_TYPE_ERR_APPEND:
+	case TOKEN_TYPE_ERR_DUP:
+		return parser_start_redirect(p, tail, PARSER_STATE_EXPRS);
+	default:
+		assert(false);
+		return PARSER_ERR_NONE;
 	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+}
+
+/** Handle a complete token which is not a line end. */
+static enum parser_error
+parser_add_token(struct parser *p)
+{
+	struct command_line *line = p->line;
+	switch (p->state) {
+	case PARSER_STATE_EXPRS:
+		return parser_add_expr(p);
+	case PARSER_STATE_REDIRECT: {
+		struct expr *tail = command_line_tail(line, p->group);
+		enum parser_error err =
+			parser_add_redirect(p, p->redirect_type, &tail->cmd);
+		p->state = p->redirect_return;
+		return err;
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+	case PARSER_STATE_OUT_FILE:
+		if (p->token.type != TOKEN_TYPE_STR)
+			return PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+		line->out_file = token_commit(&p->token);
+		p->state = PARSER_STATE_AFTER_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case PARSER_STATE_AFTER_OUT_FILE:
+		/* Redirections of the last command can go after the file. */
+		if (token_is_redirect(p->token.type)) {
+			return parser_start_redirect(p, line->tail,
+						     PARSER_STATE_AFTER_OUT_FILE);
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
+		if (p->token.type == TOKEN_TYPE_BACKGROUND) {
+			line->is_background = true;
+			p->state = PARSER_STATE_AFTER_BACKGROUND;
+			return PARSER_ERR_NONE;
+		}
+		return PARSER_ERR_TOO_LATE_ARGUMENTS;
+	case PARSER_STATE_AFTER_BACKGROUND:
+		return PARSER_ERR_TOO_LATE_ARGUMENTS;
+	case PARSER_STATE_SKIP:
+		return PARSER_ERR_NONE;
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
+	assert(false);
+	return PARSER_ERR_NONE;
+}
 
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
-		}
+/**
+ * Finish the line at its end.
+ * @retval PARSER_ERR_NONE The line is complete.
+ * @return The error of the line, it is dropped.
+ */
+static enum parser_error
+parser_end_line(struct parser *p)
+{
+	struct command_line *line = p->line;
+	switch (p->state) {
+	case PARSER_STATE_EXPRS:
+		if (p->group != NULL)
+			return PARSER_ERR_GROUP_NOT_CLOSED;
+		assert(line->tail != NULL);
+		if (!expr_is_operand(line->tail))
+			return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		return PARSER_ERR_NONE;
+	case PARSER_STATE_REDIRECT:
+	case PARSER_STATE_OUT_FILE:
+		return PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+	case PARSER_STATE_AFTER_OUT_FILE:
+	case PARSER_STATE_AFTER_BACKGROUND:
+		assert(line->tail != NULL);
+		if (!expr_is_operand(line->tail))
+			return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		return PARSER_ERR_NONE;
+	case PARSER_STATE_SKIP:
+		return p->error;
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+	assert(false);
+	return PARSER_ERR_NONE;
+}
 
-return_no_line:
-	command_line_delete(line);
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
 	*out = NULL;
-
-return_final:
-	free(token.data);
-	return res;
+	while (p->pos < p->size) {
+		if (p->token.type != TOKEN_TYPE_NONE)
+			token_reset(&p->token);
+		if (p->line == NULL) {
+			arena_reset(&p->arena);
+			p->line = arena_alloc(&p->arena, sizeof(*p->line));
+			memset(p->line, 0, sizeof(*p->line));
+			p->group = NULL;
+			p->state = PARSER_STATE_EXPRS;
+		}
+		uint32_t used = parse_token(p->data + p->pos, p->data + p->size,
+					    &p->token);
+		parser_consume(p, used);
+		if (p->token.type == TOKEN_TYPE_NONE)
+			break;
+		if (p->token.type != TOKEN_TYPE_NEW_LINE) {
+			enum parser_error err = parser_add_token(p);
+			if (err != PARSER_ERR_NONE) {
+				/*
+				 * The line can't be executed but can't just
+				 * crash here because of that. Its rest is
+				 * skipped.
+				 */
+				p->error = err;
+				p->state = PARSER_STATE_SKIP;
+			}
+			continue;
+		}
+		/* Skip empty lines. */
+		if (p->line->tail == NULL && p->state == PARSER_STATE_EXPRS)
+			continue;
+		struct command_line *line = p->line;
+		enum parser_error err = parser_end_line(p);
+		p->line = NULL;
+		if (err != PARSER_ERR_NONE)
+			return err;
+		line->arena = p->arena;
+		p->arena = NULL;
+		*out = line;
+		return PARSER_ERR_NONE;
+	}
+	return PARSER_ERR_NONE;
 }
 
 void
 parser_delete(struct parser *p)
 {
+	arena_delete(p->arena);
 	free(p->buffer);
 	free(p);
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 struct parser;
+struct arena_chunk;
 
 enum parser_error {
 	PARSER_ERR_NONE,
@@ -16,6 +17,38 @@ enum parser_error {
 	PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG,
 	PARSER_ERR_TOO_LATE_ARGUMENTS,
 	PARSER_ERR_ENDS_NOT_WITH_A_COMMAND,
+	PARSER_ERR_REDIRECT_WITH_NO_COMMAND,
+	PARSER_ERR_GROUP_WITH_LEFT_ARG,
+	PARSER_ERR_GROUP_NOT_OPENED,
+	PARSER_ERR_GROUP_NOT_CLOSED,
+	PARSER_ERR_GROUP_ENDS_NOT_WITH_A_COMMAND,
+};
+
+enum redirect_type {
+	/** Read the file, '<'. */
+	REDIRECT_TYPE_FILE_READ,
+	/** Truncate or create the file and write it, '2>'. */
+	REDIRECT_TYPE_FILE_NEW,
+	/** Write to the end of the file, '2>>'. */
+	REDIRECT_TYPE_FILE_APPEND,
+	/** Make the descriptor a copy of stdout, '2>&1'. */
+	REDIRECT_TYPE_STDOUT,
+	/** Read the target string with a new line after it, '<<<'. */
+	REDIRECT_TYPE_HERE_STRING,
+};
+
+/**
+ * Redirection of a descriptor of one command. They are applied in the
+ * order of appearance, after the pipes and the output file of the
+ * line.
+ */
+struct redirect {
+	enum redirect_type type;
+	/** Descriptor to replace: 0 or 2. */
+	int fd;
+	/** File name or the here-string. NULL for the STDOUT type. */
+	char *target;
+	struct redirect *next;
 };
 
 struct command {
@@ -23,6 +56,7 @@ struct command {
 	char** args;
 	uint32_t arg_count;
 	uint32_t arg_capacity;
+	struct redirect *redirects;
 };
 
 enum expr_type {
@@ -30,12 +64,32 @@ enum expr_type {
 	EXPR_TYPE_PIPE,
 	EXPR_TYPE_AND,
 	EXPR_TYPE_OR,
+	/** Expressions in parentheses, run in a child shell. */
+	EXPR_TYPE_SUBSHELL,
 };
 
+/**
+ * The line is a tree. Each level is a list of operands, which are
+ * commands and subshells, with the operators between them. A subshell
+ * holds the list of its own level.
+ */
 struct expr {
 	enum expr_type type;
-	/** Valid if the type is COMMAND. */
+	/**
+	 * Valid if the type is COMMAND. A SUBSHELL has only the redirects
+	 * here, which are applied to the whole group.
+	 */
 	struct command cmd;
+	/** Valid if the type is SUBSHELL. */
+	struct expr *body;
+	struct expr *body_tail;
+	/** Enclosing subshell of a SUBSHELL, NULL on the top level. */
+	struct expr *parent;
+	/**
+	 * A SUBSHELL prefixed with 'time'. A 'time' before a command is
+	 * its first word, but a subshell has no words to keep it in.
+	 */
+	bool is_timed;
 	struct expr *next;
 };
 
@@ -52,6 +106,11 @@ struct command_line {
 	/** Valid if the out type is FILE. */
 	char *out_file;
 	bool is_background;
+	/**
+	 * Memory of the line itself, its expressions, strings and argument
+	 * arrays. All of them are freed at once.
+	 */
+	struct arena_chunk *arena;
 };
 
 void
@@ -63,6 +122,15 @@ parser_new(void);
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
+/**
+ * Same as parser_feed() but the data is parsed in place without
+ * copying, for example right from a mapped file. It has to stay
+ * valid and unchanged until all its lines are popped or until the
+ * next feed, which copies the not parsed rest.
+ */
+void
+parser_feed_external(struct parser *p, const char *str, uint32_t len);
+
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
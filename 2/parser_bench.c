@@ -0,0 +1,277 @@
+#include "parser.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+/*
+ * Usage: parser_bench [script [line_count] | tests [iterations] |
+ *                      long [size_kb]]
+ * Without arguments all the benchmarks are run with default sizes.
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void
+bench_report(const char *name, uint64_t lines, uint64_t bytes, double sec)
+{
+	printf("%-24s %10.3f ms %12.0f lines/s %10.1f MB/s\n", name,
+	       sec * 1000, lines / sec, bytes / sec / 1024 / 1024);
+}
+
+/** Pop all the complete lines, return their count. */
+static uint64_t
+bench_pop_all(struct parser *p)
+{
+	uint64_t count = 0;
+	struct command_line *line;
+	while (true) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			return count;
+		assert(err == PARSER_ERR_NONE);
+		command_line_delete(line);
+		++count;
+	}
+}
+
+/** Build a script with @a count lines like the ones from the tests. */
+static char *
+bench_make_script(uint32_t count, uint32_t *size)
+{
+	static const char *templates[] = {
+		"echo 'source string' | sed 's/source/destination/g'\n",
+		"cat \"my file with whitespaces in name.txt\" > result.txt\n",
+		"true || false && echo 123 # comment\n",
+		"mkdir -p ../testdir/a/b/c && cd ../testdir\n",
+		"echo 123\\\n456 | grep 4 >> log.txt\n",
+		"sleep 0 &\n",
+	};
+	uint32_t template_count = sizeof(templates) / sizeof(templates[0]);
+	uint32_t capacity = 0;
+	for (uint32_t i = 0; i < template_count; ++i)
+		capacity += strlen(templates[i]);
+	capacity = capacity * (count / template_count + 1);
+	char *res = malloc(capacity);
+	uint32_t len = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		const char *t = templates[i % template_count];
+		uint32_t tlen = strlen(t);
+		assert(len + tlen <= capacity);
+		memcpy(res + len, t, tlen);
+		len += tlen;
+	}
+	*size = len;
+	return res;
+}
+
+/** Feed the script like the shell reads stdin - by 1KB chunks. */
+static void
+bench_script_chunked(const char *script, uint32_t size, uint32_t count)
+{
+	struct parser *p = parser_new();
+	uint64_t lines = 0;
+	double start = bench_now();
+	for (uint32_t pos = 0; pos < size; pos += 1024) {
+		uint32_t len = size - pos < 1024 ? size - pos : 1024;
+		parser_feed(p, script + pos, len);
+		lines += bench_pop_all(p);
+	}
+	double sec = bench_now() - start;
+	parser_delete(p);
+	assert(lines == count);
+	bench_report("chunked 1KB", lines, size, sec);
+}
+
+/** Feed the whole script at once and then pop all the lines. */
+static void
+bench_script_whole(const char *script, uint32_t size, uint32_t count)
+{
+	struct parser *p = parser_new();
+	double start = bench_now();
+	parser_feed(p, script, size);
+	uint64_t lines = bench_pop_all(p);
+	double sec = bench_now() - start;
+	parser_delete(p);
+	assert(lines == count);
+	bench_report("whole buffer", lines, size, sec);
+}
+
+/** Parse the script right from a mapped file like the script mode. */
+static void
+bench_script_mapped(const char *script, uint32_t size, uint32_t count)
+{
+	char path[] = "/tmp/parser_bench_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+	ssize_t rc = write(fd, script, size);
+	assert(rc == (ssize_t)size);
+	(void)rc;
+
+	struct parser *p = parser_new();
+	double start = bench_now();
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	assert(data != MAP_FAILED);
+	parser_feed_external(p, data, size);
+	uint64_t lines = bench_pop_all(p);
+	munmap(data, size);
+	double sec = bench_now() - start;
+	parser_delete(p);
+	close(fd);
+	assert(lines == count);
+	bench_report("mapped file", lines, size, sec);
+}
+
+static void
+bench_script(uint32_t count)
+{
+	uint32_t size;
+	char *script = bench_make_script(count, &size);
+	printf("# script of %u lines, %u bytes\n", count, size);
+	bench_script_chunked(script, size, count);
+	bench_script_whole(script, size, count);
+	bench_script_mapped(script, size, count);
+	free(script);
+}
+
+/**
+ * Take the commands from tests.txt. Each of them starts after '$> ' and
+ * lasts until the parser returns a line, because some commands take
+ * multiple lines.
+ */
+static char *
+bench_load_tests(const char *path, uint32_t *size, uint32_t *count)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	long file_size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *text = malloc(file_size + 1);
+	size_t rc = fread(text, 1, file_size, f);
+	assert(rc == (size_t)file_size);
+	(void)rc;
+	text[file_size] = 0;
+	fclose(f);
+
+	char *res = malloc(file_size);
+	uint32_t len = 0;
+	*count = 0;
+	for (const char *cmd = strstr(text, "$> "); cmd != NULL;
+	     cmd = strstr(cmd, "$> ")) {
+		cmd += 3;
+		struct parser *p = parser_new();
+		struct command_line *line = NULL;
+		const char *end = cmd;
+		while (line == NULL && *end != 0) {
+			const char *next = strchr(end, '\n');
+			next = next == NULL ? text + file_size : next + 1;
+			parser_feed(p, end, next - end);
+			end = next;
+			if (parser_pop_next(p, &line) != PARSER_ERR_NONE)
+				break;
+		}
+		if (line != NULL) {
+			command_line_delete(line);
+			memcpy(res + len, cmd, end - cmd);
+			len += end - cmd;
+			++*count;
+		}
+		parser_delete(p);
+		cmd = end;
+	}
+	free(text);
+	*size = len;
+	return res;
+}
+
+/** Parse all the commands from the tests many times. */
+static void
+bench_tests(const char *path, uint32_t iterations)
+{
+	uint32_t size, count;
+	char *script = bench_load_tests(path, &size, &count);
+	printf("# %u commands from %s, %u bytes, %u times\n", count, path,
+	       size, iterations);
+	struct parser *p = parser_new();
+	uint64_t lines = 0;
+	double start = bench_now();
+	for (uint32_t i = 0; i < iterations; ++i) {
+		parser_feed_external(p, script, size);
+		lines += bench_pop_all(p);
+	}
+	double sec = bench_now() - start;
+	parser_delete(p);
+	assert(lines == (uint64_t)count * iterations);
+	bench_report("tests.txt", lines, (uint64_t)size * iterations, sec);
+	free(script);
+}
+
+/**
+ * One line with a multi-line quoted argument of @a size bytes, fed by
+ * 1KB chunks. Each chunk continues the same incomplete token.
+ */
+static void
+bench_long_argument(uint32_t size)
+{
+	char *script = malloc(size + 16);
+	uint32_t len = sprintf(script, "echo \"");
+	for (uint32_t i = 0; i < size; ++i)
+		script[len++] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	len += sprintf(script + len, "\"\n");
+	printf("# one argument of %u KB\n", size / 1024);
+	struct parser *p = parser_new();
+	uint64_t lines = 0;
+	double start = bench_now();
+	for (uint32_t pos = 0; pos < len; pos += 1024) {
+		uint32_t chunk = len - pos < 1024 ? len - pos : 1024;
+		parser_feed(p, script + pos, chunk);
+		lines += bench_pop_all(p);
+	}
+	double sec = bench_now() - start;
+	parser_delete(p);
+	assert(lines == 1);
+	bench_report("chunked 1KB", lines, len, sec);
+	free(script);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *mode = argc > 1 ? argv[1] : NULL;
+	if (mode == NULL || strcmp(mode, "script") == 0) {
+		uint32_t count = 100 * 1000;
+		if (mode != NULL && argc > 2)
+			count = atoi(argv[2]);
+		bench_script(count);
+	}
+	if (mode == NULL || strcmp(mode, "tests") == 0) {
+		uint32_t iterations = 1000 * 1000;
+		if (mode != NULL && argc > 2)
+			iterations = atoi(argv[2]);
+		bench_tests("tests.txt", iterations);
+	}
+	if (mode == NULL || strcmp(mode, "long") == 0) {
+		uint32_t size = 4 * 1024;
+		if (mode != NULL && argc > 2)
+			size = atoi(argv[2]);
+		bench_long_argument(size * 1024);
+	}
+	return 0;
+}
@@ -0,0 +1,463 @@
+#include "parser.h"
+
+#include "heap_help/heap_help.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Usage: parser_fuzz [line_count [seed]]
+ *
+ * Generate line_count (100000 by default) random command lines, valid
+ * and not, with quotes, escapes, comments, subshells, operators and
+ * redirections. The seed is the current time by default, it is printed
+ * to reproduce a failure. The script is parsed being fed in different ways, from
+ * the whole buffer at once to random chunks of a few bytes. The parsed
+ * lines and the errors must be the same for all of them, otherwise the
+ * first difference is printed and the exit code is 1.
+ *
+ * For each way the speed and the number of allocations per line are
+ * reported. The allocations are counted by heap_help, which also checks
+ * that no memory is left after the parser is deleted. Its bookkeeping is
+ * a part of the measured time, so the absolute numbers are lower than in
+ * parser_bench, but the ways of feeding are comparable between
+ * themselves.
+ */
+
+static double
+fuzz_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static uint64_t fuzz_state;
+
+/** xorshift64*, the sequence is the same for the same seed. */
+static uint32_t
+fuzz_rand(uint32_t limit)
+{
+	fuzz_state ^= fuzz_state >> 12;
+	fuzz_state ^= fuzz_state << 25;
+	fuzz_state ^= fuzz_state >> 27;
+	return (fuzz_state * 2685821657736338717ull >> 32) % limit;
+}
+
+struct fuzz_buf {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+fuzz_buf_append(struct fuzz_buf *b, const char *str, size_t len)
+{
+	if (b->size + len + 1 > b->capacity) {
+		b->capacity = (b->size + len + 1) * 2;
+		b->data = realloc(b->data, b->capacity);
+	}
+	memcpy(b->data + b->size, str, len);
+	b->size += len;
+	b->data[b->size] = 0;
+}
+
+static void
+fuzz_buf_add(struct fuzz_buf *b, const char *str)
+{
+	fuzz_buf_append(b, str, strlen(str));
+}
+
+static void
+fuzz_buf_add_char(struct fuzz_buf *b, char c)
+{
+	fuzz_buf_append(b, &c, 1);
+}
+
+static void
+fuzz_gen_word(struct fuzz_buf *b, const char *alphabet)
+{
+	uint32_t len = 1 + fuzz_rand(12);
+	uint32_t count = strlen(alphabet);
+	for (uint32_t i = 0; i < len; ++i)
+		fuzz_buf_add_char(b, alphabet[fuzz_rand(count)]);
+}
+
+/** An argument: a word, a string, an escape, possibly glued. */
+static void
+fuzz_gen_arg(struct fuzz_buf *b)
+{
+	static const char *escapes[] = {
+		"\\ ", "\\\\", "\\\"", "\\'", "\\#", "\\&", "\\|",
+		"\\>", "\\(", "\\n",
+	};
+	const char *word = "abcxyz0129-_./=";
+	uint32_t kind = fuzz_rand(100);
+	if (kind < 55) {
+		fuzz_gen_word(b, word);
+	} else if (kind < 70) {
+		fuzz_buf_add_char(b, '"');
+		fuzz_gen_word(b, "ab ' #|&><()\n$");
+		if (fuzz_rand(2) == 0) {
+			fuzz_buf_add(b, fuzz_rand(2) == 0 ? "\\\\" : "\\\"");
+			fuzz_gen_word(b, "ab ' #|&><()\n$");
+		}
+		fuzz_buf_add_char(b, '"');
+	} else if (kind < 80) {
+		fuzz_buf_add_char(b, '\'');
+		fuzz_gen_word(b, "ab \" #|&><()\n\\");
+		fuzz_buf_add_char(b, '\'');
+	} else if (kind < 85) {
+		fuzz_buf_add(b, fuzz_rand(2) == 0 ? "\"\"" : "''");
+	} else if (kind < 95) {
+		fuzz_gen_word(b, word);
+		fuzz_buf_add(b, escapes[fuzz_rand(sizeof(escapes) /
+						   sizeof(escapes[0]))]);
+	} else {
+		/* Line continuation, possibly followed by spaces. */
+		fuzz_gen_word(b, word);
+		fuzz_buf_add(b, fuzz_rand(2) == 0 ? "\\\n" : "\\\n   ");
+	}
+}
+
+/** Anything what can break a line: operators, quotes, garbage. */
+static void
+fuzz_gen_noise(struct fuzz_buf *b)
+{
+	static const char *tokens[] = {
+		"|", "||", "&&", "&", ">", ">>", "<", "<<<", "2>", "2>>",
+		"2>&1", "2>&", "(", ")", "<<", "\"", "'", "\\",
+	};
+	if (fuzz_rand(4) == 0)
+		fuzz_gen_word(b, "\t\r &|<>()#\\\"'2");
+	else
+		fuzz_buf_add(b, tokens[fuzz_rand(sizeof(tokens) /
+						  sizeof(tokens[0]))]);
+}
+
+/** Whether the current line still has to get some noise. */
+static bool fuzz_is_noisy;
+
+static void
+fuzz_gen_space(struct fuzz_buf *b)
+{
+	if (fuzz_is_noisy && fuzz_rand(4) == 0) {
+		fuzz_buf_add_char(b, ' ');
+		fuzz_gen_noise(b);
+		fuzz_is_noisy = false;
+	}
+	fuzz_buf_add(b, fuzz_rand(8) == 0 ? " \t " : " ");
+}
+
+static void
+fuzz_gen_list(struct fuzz_buf *b, int depth);
+
+/** A command with its arguments or a subshell, with redirections. */
+static void
+fuzz_gen_stage(struct fuzz_buf *b, int depth)
+{
+	static const char *redirects[] = {"<", "<<<", "2>", "2>>"};
+	if (depth < 2 && fuzz_rand(8) == 0) {
+		fuzz_buf_add(b, "(");
+		fuzz_gen_list(b, depth + 1);
+		fuzz_buf_add(b, ")");
+	} else {
+		uint32_t count = 1 + fuzz_rand(3);
+		for (uint32_t i = 0; i < count; ++i) {
+			fuzz_gen_arg(b);
+			fuzz_gen_space(b);
+		}
+	}
+	if (fuzz_rand(6) == 0) {
+		fuzz_gen_space(b);
+		if (fuzz_rand(4) == 0) {
+			fuzz_buf_add(b, "2>&1");
+		} else {
+			fuzz_buf_add(b, redirects[fuzz_rand(4)]);
+			fuzz_gen_space(b);
+			fuzz_gen_arg(b);
+		}
+		fuzz_gen_space(b);
+	}
+}
+
+static void
+fuzz_gen_list(struct fuzz_buf *b, int depth)
+{
+	static const char *operators[] = {"|", "||", "&&"};
+	fuzz_gen_stage(b, depth);
+	uint32_t count = fuzz_rand(3);
+	for (uint32_t i = 0; i < count; ++i) {
+		fuzz_buf_add(b, operators[fuzz_rand(3)]);
+		fuzz_gen_space(b);
+		fuzz_gen_stage(b, depth);
+	}
+}
+
+/**
+ * A line follows the grammar, with occasional noise making it invalid,
+ * like an operator in a wrong place or an unbalanced quote.
+ */
+static void
+fuzz_gen_line(struct fuzz_buf *b)
+{
+	if (fuzz_rand(20) == 0) {
+		fuzz_buf_add(b, fuzz_rand(2) == 0 ? "\n" : "  # comment\n");
+		return;
+	}
+	fuzz_is_noisy = fuzz_rand(8) == 0;
+	fuzz_gen_list(b, 0);
+	uint32_t tail = fuzz_rand(10);
+	if (tail == 0) {
+		fuzz_buf_add(b, "> ");
+		fuzz_gen_arg(b);
+	} else if (tail == 1) {
+		fuzz_buf_add(b, ">> ");
+		fuzz_gen_arg(b);
+	}
+	if (fuzz_rand(10) == 0)
+		fuzz_buf_add(b, " &");
+	if (fuzz_rand(10) == 0)
+		fuzz_buf_add(b, " # comment | && \" '");
+	fuzz_buf_add_char(b, '\n');
+}
+
+static void
+fuzz_dump_str(struct fuzz_buf *b, const char *str)
+{
+	char head[32];
+	snprintf(head, sizeof(head), " %zu:", strlen(str));
+	fuzz_buf_add(b, head);
+	fuzz_buf_add(b, str);
+}
+
+static void
+fuzz_dump_exprs(struct fuzz_buf *b, const struct expr *e)
+{
+	for (; e != NULL; e = e->next) {
+		char head[32];
+		snprintf(head, sizeof(head), " e%d", (int)e->type);
+		fuzz_buf_add(b, head);
+		if (e->type == EXPR_TYPE_COMMAND) {
+			fuzz_dump_str(b, e->cmd.exe);
+			for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+				fuzz_dump_str(b, e->cmd.args[i]);
+		} else if (e->type == EXPR_TYPE_SUBSHELL) {
+			fuzz_buf_add(b, " (");
+			fuzz_dump_exprs(b, e->body);
+			fuzz_buf_add(b, " )");
+		}
+		for (const struct redirect *r = e->cmd.redirects; r != NULL;
+		     r = r->next) {
+			snprintf(head, sizeof(head), " r%d/%d", (int)r->type,
+				 r->fd);
+			fuzz_buf_add(b, head);
+			if (r->target != NULL)
+				fuzz_dump_str(b, r->target);
+		}
+	}
+}
+
+/** Text of a line with all its details, one line per parsed line. */
+static void
+fuzz_dump_line(struct fuzz_buf *b, const struct command_line *line)
+{
+	fuzz_dump_exprs(b, line->head);
+	char tail[32];
+	snprintf(tail, sizeof(tail), " o%d", (int)line->out_type);
+	fuzz_buf_add(b, tail);
+	if (line->out_file != NULL)
+		fuzz_dump_str(b, line->out_file);
+	fuzz_buf_add(b, line->is_background ? " &\n" : "\n");
+}
+
+struct fuzz_result {
+	uint64_t lines;
+	uint64_t errors;
+	uint64_t allocs;
+	double sec;
+};
+
+/** Pop everything what is complete, dump it if @a dump is given. */
+static void
+fuzz_pop_all(struct parser *p, struct fuzz_buf *dump,
+	     struct fuzz_result *res)
+{
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			++res->errors;
+			if (dump != NULL) {
+				char text[32];
+				snprintf(text, sizeof(text), "error %d\n",
+					 (int)err);
+				fuzz_buf_add(dump, text);
+			}
+			continue;
+		}
+		if (line == NULL)
+			return;
+		++res->lines;
+		if (dump != NULL)
+			fuzz_dump_line(dump, line);
+		command_line_delete(line);
+	}
+}
+
+enum fuzz_feed {
+	/** The whole script at once. */
+	FUZZ_FEED_WHOLE,
+	/** The whole script at once without copying. */
+	FUZZ_FEED_EXTERNAL,
+	/** 1KB chunks like the shell reads stdin. */
+	FUZZ_FEED_1KB,
+	/** Random chunks of 1 - 4096 bytes. */
+	FUZZ_FEED_RANDOM_LARGE,
+	/** Random chunks of 1 - 16 bytes. */
+	FUZZ_FEED_RANDOM_SMALL,
+	/** Random chunks of 1 - 64 bytes without copying. */
+	FUZZ_FEED_RANDOM_EXTERNAL,
+	/** Byte by byte. */
+	FUZZ_FEED_BYTES,
+	fuzz_feed_MAX,
+};
+
+static const char *fuzz_feed_names[] = {
+	"whole buffer", "whole external", "chunks of 1KB",
+	"random 1-4096 bytes", "random 1-16 bytes",
+	"random 1-64 external", "byte by byte",
+};
+
+static uint32_t
+fuzz_chunk_size(enum fuzz_feed feed)
+{
+	switch (feed) {
+	case FUZZ_FEED_1KB:
+		return 1024;
+	case FUZZ_FEED_RANDOM_LARGE:
+		return 1 + fuzz_rand(4096);
+	case FUZZ_FEED_RANDOM_SMALL:
+		return 1 + fuzz_rand(16);
+	case FUZZ_FEED_RANDOM_EXTERNAL:
+		return 1 + fuzz_rand(64);
+	case FUZZ_FEED_BYTES:
+		return 1;
+	default:
+		return UINT32_MAX;
+	}
+}
+
+/**
+ * Parse the script fed the given way. With @a dump the results are
+ * collected for the comparison, without it only the time is measured.
+ */
+static void
+fuzz_parse(const char *script, uint32_t size, enum fuzz_feed feed,
+	   struct fuzz_buf *dump, struct fuzz_result *res)
+{
+	memset(res, 0, sizeof(*res));
+	/* The dump is not the parser memory, allocate it beforehand. */
+	if (dump != NULL)
+		fuzz_buf_append(dump, "", 0);
+	uint64_t live = heaph_get_alloc_count();
+	uint64_t allocs = heaph_get_alloc_count_total();
+	double start = fuzz_now();
+	struct parser *p = parser_new();
+	bool is_external = feed == FUZZ_FEED_EXTERNAL ||
+			   feed == FUZZ_FEED_RANDOM_EXTERNAL;
+	uint32_t pos = 0;
+	while (pos < size) {
+		uint32_t len = fuzz_chunk_size(feed);
+		if (len > size - pos)
+			len = size - pos;
+		if (is_external)
+			parser_feed_external(p, script + pos, len);
+		else
+			parser_feed(p, script + pos, len);
+		pos += len;
+		fuzz_pop_all(p, dump, res);
+	}
+	/* An unbalanced quote can keep the end of the script. */
+	parser_feed(p, "\n", 1);
+	fuzz_pop_all(p, dump, res);
+	parser_delete(p);
+	res->sec = fuzz_now() - start;
+	res->allocs = heaph_get_alloc_count_total() - allocs;
+	if (heaph_get_alloc_count() != live) {
+		printf("%s: %lld allocations are not freed\n",
+		       fuzz_feed_names[feed],
+		       (long long)(heaph_get_alloc_count() - live));
+		exit(1);
+	}
+}
+
+/** Show where the dumps diverge, with the line of the script. */
+static void
+fuzz_report_diff(const struct fuzz_buf *expected, const struct fuzz_buf *got,
+		 enum fuzz_feed feed)
+{
+	size_t i = 0;
+	uint32_t line = 0;
+	while (i < expected->size && i < got->size &&
+	       expected->data[i] == got->data[i]) {
+		if (expected->data[i] == '\n')
+			++line;
+		++i;
+	}
+	printf("%s: result %u differs from the whole buffer parsing\n",
+	       fuzz_feed_names[feed], line);
+	const char *e = expected->data + i;
+	const char *g = got->data + i;
+	printf("expected: %.*s\n", (int)strcspn(e, "\n"), e);
+	printf("got:      %.*s\n", (int)strcspn(g, "\n"), g);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t count = 100 * 1000;
+	uint64_t seed = time(NULL);
+	if (argc > 1)
+		count = atoi(argv[1]);
+	if (argc > 2)
+		seed = strtoull(argv[2], NULL, 10);
+	fuzz_state = seed == 0 ? 1 : seed;
+
+	struct fuzz_buf script = {NULL, 0, 0};
+	for (uint32_t i = 0; i < count; ++i)
+		fuzz_gen_line(&script);
+	printf("# %u random lines, %zu bytes, seed %llu\n", count,
+	       script.size, (unsigned long long)seed);
+
+	struct fuzz_buf expected = {NULL, 0, 0};
+	struct fuzz_result res;
+	fuzz_parse(script.data, script.size, FUZZ_FEED_WHOLE, &expected, &res);
+	printf("# %llu lines and %llu errors\n", (unsigned long long)res.lines,
+	       (unsigned long long)res.errors);
+	int rc = 0;
+	for (int feed = 0; feed < fuzz_feed_MAX; ++feed) {
+		/* The check first, then a clean measurement. */
+		struct fuzz_buf got = {NULL, 0, 0};
+		fuzz_parse(script.data, script.size, feed, &got, &res);
+		if (got.size != expected.size ||
+		    memcmp(got.data, expected.data, got.size) != 0) {
+			fuzz_report_diff(&expected, &got, feed);
+			rc = 1;
+		}
+		free(got.data);
+		fuzz_parse(script.data, script.size, feed, NULL, &res);
+		uint64_t parsed = res.lines + res.errors;
+		printf("%-22s %10.3f ms %12.0f lines/s %8.1f MB/s "
+		       "%6.2f allocs/line\n", fuzz_feed_names[feed],
+		       res.sec * 1000, parsed / res.sec,
+		       script.size / res.sec / 1024 / 1024,
+		       (double)res.allocs / parsed);
+	}
+	free(expected.data);
+	free(script.data);
+	return rc;
+}
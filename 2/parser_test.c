@@ -279,6 +279,74 @@ test_output_redirect(void)
 	unit_test_finish();
 }
 
+static void
+test_redirects(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "cat < in.txt 2> err.txt | grep x 2>&1 <<< 'a b' "
+		"> out.txt 2>> log.txt";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->out_type == OUTPUT_TYPE_FILE_NEW, "out type");
+	unit_check(strcmp(line->out_file, "out.txt") == 0, "out file");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "cat") == 0, "exe");
+	unit_check(e->cmd.arg_count == 0, "arg count");
+	struct redirect *r = e->cmd.redirects;
+	unit_check(r->type == REDIRECT_TYPE_FILE_READ && r->fd == 0 &&
+		   strcmp(r->target, "in.txt") == 0, "input file");
+	r = r->next;
+	unit_check(r->type == REDIRECT_TYPE_FILE_NEW && r->fd == 2 &&
+		   strcmp(r->target, "err.txt") == 0, "stderr file");
+	unit_check(r->next == NULL, "no more redirects");
+
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_PIPE, "pipe");
+	e = e->next;
+	unit_check(strcmp(e->cmd.exe, "grep") == 0, "exe");
+	unit_check(e->cmd.arg_count == 1, "arg count");
+	r = e->cmd.redirects;
+	unit_check(r->type == REDIRECT_TYPE_STDOUT && r->fd == 2 &&
+		   r->target == NULL, "stderr to stdout");
+	r = r->next;
+	unit_check(r->type == REDIRECT_TYPE_HERE_STRING && r->fd == 0 &&
+		   strcmp(r->target, "a b") == 0, "here-string");
+	r = r->next;
+	unit_check(r->type == REDIRECT_TYPE_FILE_APPEND && r->fd == 2 &&
+		   strcmp(r->target, "log.txt") == 0, "stderr append");
+	unit_check(r->next == NULL, "no more redirects");
+	unit_check(e->next == NULL, "no more exprs");
+	command_line_delete(line);
+
+	unit_msg("Not a stderr redirect");
+	str = "echo a2>f '2'>g";
+	parser_feed(p, str, strlen(str));
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) ==
+		   PARSER_ERR_TOO_LATE_ARGUMENTS, "'2' is an argument");
+	str = "echo 2 a2>f\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[1], "a2") == 0, "arg[1]");
+	unit_check(e->cmd.redirects == NULL, "no redirects");
+	unit_check(strcmp(line->out_file, "f") == 0, "out file");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_escape_outside_of_string(void)
 {
@@ -364,6 +432,72 @@ test_escape_outside_of_string(void)
 	unit_check(e->next == NULL, "no more exprs");
 	command_line_delete(line);
 
+	unit_msg("Escape new line before spaces");
+	/*
+	 * echo \
+	 *    456 \
+	 *    2> err
+	 */
+	str = "echo \\\n   456 \\\n   2> err";
+	len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 1, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "456") == 0, "arg[0]");
+	unit_check(e->cmd.redirects != NULL, "redirect");
+	unit_check(e->cmd.redirects->fd == 2, "redirect fd");
+	unit_check(e->next == NULL, "no more exprs");
+	command_line_delete(line);
+
+	parser_feed(p, "echo \\\n\n", 8);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 0, "escaped new line and the end");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_empty_strings(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "echo \"\" a '' \"\"";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 4, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "a") == 0, "arg[1]");
+	unit_check(strcmp(e->cmd.args[2], "") == 0, "arg[2]");
+	unit_check(strcmp(e->cmd.args[3], "") == 0, "arg[3]");
+	command_line_delete(line);
+
+	parser_feed(p, "\"\" > ''\n", 8);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "") == 0, "empty exe");
+	unit_check(strcmp(line->out_file, "") == 0, "empty out file");
+	command_line_delete(line);
+
 	parser_delete(p);
 	unit_test_finish();
 }
@@ -604,6 +738,48 @@ test_multiline_string(void)
 	unit_test_finish();
 }
 
+static void
+test_long_words(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	/*
+	 * Words are copied by long runs of ordinary symbols. Put a special
+	 * symbol at each offset of a long word to check all of them stop
+	 * the run, in and out of quotes.
+	 */
+	char word[80], str[512], expected[256];
+	for (int i = 0; i < 70; ++i) {
+		memset(word, 'a' + i % 26, i);
+		word[i] = 0;
+		int len = snprintf(str, sizeof(str), "%s\\ %s|x\n", word, word);
+		parser_feed(p, str, len);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line == NULL || line->head->next == NULL);
+		snprintf(expected, sizeof(expected), "%s %s", word, word);
+		unit_fail_if(strcmp(line->head->cmd.exe, expected) != 0);
+		unit_fail_if(line->head->next->type != EXPR_TYPE_PIPE);
+		command_line_delete(line);
+
+		len = snprintf(str, sizeof(str), "x \"%s'\\\"%s\" '%s\"%s'\n",
+			       word, word, word, word);
+		parser_feed(p, str, len);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line == NULL || line->head->cmd.arg_count != 2);
+		snprintf(expected, sizeof(expected), "%s'\"%s", word, word);
+		unit_fail_if(strcmp(line->head->cmd.args[0], expected) != 0);
+		snprintf(expected, sizeof(expected), "%s\"%s", word, word);
+		unit_fail_if(strcmp(line->head->cmd.args[1], expected) != 0);
+		command_line_delete(line);
+	}
+	unit_check(true, "special symbols at all offsets");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_logical_operators(void)
 {
@@ -773,6 +949,73 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_subshells(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "(a || (b)) | c && (d 'e)') 2> err";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(e->type == EXPR_TYPE_SUBSHELL, "expr type");
+	unit_check(e->parent == NULL, "top level");
+	struct expr *group = e;
+	e = group->body;
+	unit_check(e->type == EXPR_TYPE_COMMAND, "body expr type");
+	unit_check(strcmp(e->cmd.exe, "a") == 0, "body exe");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_OR, "body expr type");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_SUBSHELL, "nested expr type");
+	unit_check(e->parent == group, "nested parent");
+	unit_check(e == group->body_tail && e->next == NULL, "body end");
+	unit_check(strcmp(e->body->cmd.exe, "b") == 0, "nested exe");
+	unit_check(e->body->next == NULL, "nested end");
+
+	e = group->next;
+	unit_check(e->type == EXPR_TYPE_PIPE, "expr type");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
+	unit_check(strcmp(e->cmd.exe, "c") == 0, "exe");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_AND, "expr type");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_SUBSHELL, "expr type");
+	unit_check(e->body->cmd.arg_count == 1, "quoted parenthesis");
+	unit_check(strcmp(e->body->cmd.args[0], "e)") == 0, "arg[0]");
+	unit_check(e->cmd.redirects != NULL, "group redirect");
+	unit_check(e->cmd.redirects->fd == 2, "redirect fd");
+	unit_check(strcmp(e->cmd.redirects->target, "err") == 0,
+		   "redirect target");
+	unit_check(e->next == NULL && e == line->tail, "no more exprs");
+	command_line_delete(line);
+
+	parser_feed(p, "time (a | b) | c && time (d)\n", 29);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse timed");
+	e = line->head;
+	unit_check(e->type == EXPR_TYPE_SUBSHELL && e->is_timed, "timed group");
+	unit_check(e->cmd.exe == NULL, "no time command");
+	unit_check(strcmp(e->body->cmd.exe, "a") == 0, "timed body");
+	e = e->next->next;
+	unit_check(e->type == EXPR_TYPE_COMMAND && !e->is_timed, "after timed");
+	e = e->next->next;
+	unit_check(e->type == EXPR_TYPE_SUBSHELL && e->is_timed, "timed group");
+	unit_check(e->next == NULL && e == line->tail, "no more exprs");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -805,9 +1048,32 @@ test_errors(void)
 	test_error_one(p, "exe > &&", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
 	test_error_one(p, "exe >> &&", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
 	test_error_one(p, "exe > test.txt & arg", PARSER_ERR_TOO_LATE_ARGUMENTS);
+	test_error_one(p, "exe < &&", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe <", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe << end", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe 2>&2", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe > f 2>", PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "2> err", PARSER_ERR_REDIRECT_WITH_NO_COMMAND);
+	test_error_one(p, "> out", PARSER_ERR_REDIRECT_WITH_NO_COMMAND);
+	test_error_one(p, ">> out 2>&1", PARSER_ERR_REDIRECT_WITH_NO_COMMAND);
+	test_error_one(p, " &", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "exe | > out", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "exe | < f", PARSER_ERR_REDIRECT_WITH_NO_COMMAND);
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "exe (a)", PARSER_ERR_GROUP_WITH_LEFT_ARG);
+	test_error_one(p, "(a) (b)", PARSER_ERR_GROUP_WITH_LEFT_ARG);
+	test_error_one(p, "time a (b)", PARSER_ERR_GROUP_WITH_LEFT_ARG);
+	test_error_one(p, "time 2> f (b)", PARSER_ERR_GROUP_WITH_LEFT_ARG);
+	test_error_one(p, "a | time (b)", PARSER_ERR_GROUP_WITH_LEFT_ARG);
+	test_error_one(p, "(a | time (b))", PARSER_ERR_GROUP_WITH_LEFT_ARG);
+	test_error_one(p, "(a) b", PARSER_ERR_TOO_LATE_ARGUMENTS);
+	test_error_one(p, "a)", PARSER_ERR_GROUP_NOT_OPENED);
+	test_error_one(p, "(a", PARSER_ERR_GROUP_NOT_CLOSED);
+	test_error_one(p, "((a) > f", PARSER_ERR_GROUP_NOT_CLOSED);
+	test_error_one(p, "()", PARSER_ERR_GROUP_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "(a |)", PARSER_ERR_GROUP_ENDS_NOT_WITH_A_COMMAND);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
@@ -827,12 +1093,16 @@ main(void)
 	test_two_words();
 	test_escape_in_string();
 	test_output_redirect();
+	test_redirects();
 	test_escape_outside_of_string();
+	test_empty_strings();
 	test_pipe();
 	test_comments();
 	test_multiline_string();
+	test_long_words();
 	test_logical_operators();
 	test_background();
+	test_subshells();
 	test_errors();
 	return 0;
 }
@@ -0,0 +1,253 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+/*
+ * Usage: pipeline_bench [tools [size_mb] | stages [count [size_mb]] |
+ *                        control [length [depth]]]
+ * Without arguments all the benchmarks are run with default sizes.
+ *
+ * tools - pipe a file of size_mb megabytes (1024 by default) through
+ *     the shell ./a.out with the builtin 'cat' and 'tee', and with the
+ *     external ones for comparison.
+ * stages - pipe a file through count (8 by default) stages of 'cat'
+ *     with the different pipe sizes and CPU pinning set in the shell.
+ * control - run lines of length (1000 by default) builtin commands
+ *     joined with '&&' and '||', which mostly are skipped, and
+ *     subshells nested depth (16 by default) times.
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void
+bench_make_file(const char *path, uint64_t size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	assert(fd >= 0);
+	char buf[64 * 1024];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i * 7 % 26;
+	for (uint64_t done = 0; done < size; done += sizeof(buf)) {
+		size_t len = size - done < sizeof(buf) ? size - done : sizeof(buf);
+		ssize_t rc = write(fd, buf, len);
+		assert(rc == (ssize_t)len);
+		(void)rc;
+	}
+	close(fd);
+}
+
+/** Run one line in the shell, return its duration in seconds. */
+static double
+bench_run(const char *shell, const char *line)
+{
+	char script[] = "/tmp/pipeline_bench_script_XXXXXX";
+	int fd = mkstemp(script);
+	assert(fd >= 0);
+	ssize_t rc = write(fd, line, strlen(line));
+	assert(rc == (ssize_t)strlen(line));
+	(void)rc;
+	close(fd);
+
+	double start = bench_now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		execl(shell, shell, script, NULL);
+		perror(shell);
+		_exit(1);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	double sec = bench_now() - start;
+	unlink(script);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fprintf(stderr, "failed: %s", line);
+	return sec;
+}
+
+static void
+bench_case(const char *shell, const char *name, const char *tools,
+	   const char *line, uint64_t size)
+{
+	double sec = bench_run(shell, line);
+	char title[128];
+	snprintf(title, sizeof(title), "%s, %s", name, tools);
+	printf("%-40s %10.3f ms %8.2f GB/s\n", title, sec * 1000,
+	       size / sec / 1024 / 1024 / 1024);
+}
+
+/** Run all the pipelines with the given 'cat' and 'tee'. */
+static void
+bench_tools(const char *shell, const char *tools, const char *cat,
+	    const char *tee, const char *in, uint64_t size)
+{
+	const char *out1 = "/tmp/pipeline_bench_out1";
+	const char *out2 = "/tmp/pipeline_bench_out2";
+	char line[1024];
+	snprintf(line, sizeof(line), "%s %s > %s\n", cat, in, out1);
+	bench_case(shell, "file > file", tools, line, size);
+	snprintf(line, sizeof(line), "%s %s | %s | %s > %s\n", cat, in, cat,
+		 cat, out1);
+	bench_case(shell, "file | cat | cat > file", tools, line, size);
+	snprintf(line, sizeof(line), "%s %s | %s %s | %s > %s\n", cat, in,
+		 tee, out1, cat, out2);
+	bench_case(shell, "file | tee file | cat > file", tools, line, size);
+	snprintf(line, sizeof(line), "%s %s | %s > /dev/null\n", cat, in,
+		 cat);
+	bench_case(shell, "file | cat > /dev/null", tools, line, size);
+	unlink(out1);
+	unlink(out2);
+}
+
+static void
+bench_stages(const char *shell, uint32_t count, const char *in,
+	     uint64_t size)
+{
+	static const char *settings[][2] = {
+		{"default pipes", ""},
+		{"1MB pipes", "shellopt pipesize 1048576\n"},
+		{"pinned CPUs", "shellopt pincpu on\n"},
+		{"1MB pipes, pinned CPUs",
+		 "shellopt pipesize 1048576\nshellopt pincpu on\n"},
+	};
+	char *line = malloc(1024 + count * 16);
+	for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); ++i) {
+		int len = sprintf(line, "%s/bin/cat %s", settings[i][1], in);
+		/* External cat copies through the user space. */
+		for (uint32_t j = 1; j < count; ++j)
+			len += sprintf(line + len, " | /bin/cat");
+		sprintf(line + len, " > /dev/null\n");
+		char tools[64];
+		snprintf(tools, sizeof(tools), "%u stages", count);
+		bench_case(shell, settings[i][0], tools, line, size);
+	}
+	free(line);
+}
+
+/**
+ * Script of @a count lines, each is @a line. The last line succeeds, so
+ * does the script.
+ */
+static char *
+bench_repeat(const char *line, uint32_t count)
+{
+	const char *last = "cd .\n";
+	size_t len = strlen(line);
+	char *script = malloc(len * count + strlen(last) + 1);
+	for (uint32_t i = 0; i < count; ++i)
+		memcpy(script + i * len, line, len);
+	strcpy(script + len * count, last);
+	return script;
+}
+
+static void
+bench_control_case(const char *shell, const char *name, const char *line,
+		   uint32_t count)
+{
+	char *script = bench_repeat(line, count);
+	double sec = bench_run(shell, script);
+	free(script);
+	printf("%-40s %10.3f ms %8.2f us/line\n", name, sec * 1000,
+	       sec * 1000000 / count);
+}
+
+static void
+bench_control(const char *shell, uint32_t length, uint32_t depth)
+{
+	/* 'cd .' is a builtin, the lines don't fork. */
+	const char *ok = "cd .";
+	const char *fail = "cd /nonexistent";
+	char *line = malloc(length * 24 + depth * 2 + 64);
+	int len = sprintf(line, "%s", fail);
+	for (uint32_t i = 1; i < length; ++i)
+		len += sprintf(line + len, " && %s", ok);
+	sprintf(line + len, "\n");
+	bench_control_case(shell, "failed &&, the rest skipped", line, 1000);
+
+	len = sprintf(line, "%s", ok);
+	for (uint32_t i = 1; i < length; ++i)
+		len += sprintf(line + len, " || %s", ok);
+	sprintf(line + len, "\n");
+	bench_control_case(shell, "succeeded ||, the rest skipped", line,
+			   1000);
+
+	len = sprintf(line, "%s", fail);
+	for (uint32_t i = 1; i < length; ++i) {
+		len += sprintf(line + len, i % 2 == 0 ? " || %s" : " && %s",
+			       i % 4 == 1 ? ok : fail);
+	}
+	sprintf(line + len, "\n");
+	bench_control_case(shell, "alternating && and ||", line, 1000);
+
+	/* Each level of nesting is a forked process. */
+	len = 0;
+	for (uint32_t i = 0; i < depth; ++i)
+		line[len++] = '(';
+	len += sprintf(line + len, "%s", ok);
+	for (uint32_t i = 0; i < depth; ++i)
+		line[len++] = ')';
+	sprintf(line + len, " && %s\n", ok);
+	char name[64];
+	snprintf(name, sizeof(name), "subshells nested %u times", depth);
+	bench_control_case(shell, name, line, 100);
+	free(line);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *shell = "./a.out";
+	const char *in = "/tmp/pipeline_bench_in";
+	const char *mode = argc > 1 ? argv[1] : NULL;
+	if (mode == NULL || strcmp(mode, "tools") == 0) {
+		uint64_t size = 1024;
+		if (mode != NULL && argc > 2)
+			size = atoi(argv[2]);
+		size *= 1024 * 1024;
+		bench_make_file(in, size);
+		printf("# %llu MB through %s\n",
+		       (unsigned long long)size >> 20, shell);
+		bench_tools(shell, "builtin", "cat", "tee", in, size);
+		bench_tools(shell, "external", "/bin/cat", "/usr/bin/tee", in,
+			    size);
+	}
+	if (mode == NULL || strcmp(mode, "stages") == 0) {
+		uint32_t count = 8;
+		uint64_t size = 1024;
+		if (mode != NULL && argc > 2)
+			count = atoi(argv[2]);
+		if (mode != NULL && argc > 3)
+			size = atoi(argv[3]);
+		size *= 1024 * 1024;
+		bench_make_file(in, size);
+		printf("# %llu MB through %u stages of %s\n",
+		       (unsigned long long)size >> 20, count, shell);
+		bench_stages(shell, count, in, size);
+	}
+	if (mode == NULL || strcmp(mode, "control") == 0) {
+		uint32_t length = 1000;
+		uint32_t depth = 16;
+		if (mode != NULL && argc > 2)
+			length = atoi(argv[2]);
+		if (mode != NULL && argc > 3)
+			depth = atoi(argv[3]);
+		if (length == 0)
+			length = 1;
+		printf("# lines of %u commands through %s\n", length, shell);
+		bench_control(shell, length, depth);
+	}
+	unlink(in);
+	return 0;
+}
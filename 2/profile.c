@@ -0,0 +1,244 @@
+#include "profile.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+struct profile_stage {
+	char *name;
+	uint64_t count;
+	struct profile_usage usage;
+};
+
+struct profile_line {
+	char *text;
+	/** How many times the line was executed. */
+	uint64_t count;
+	/** Total wall clock time of all the runs. */
+	double real;
+	struct profile_stage *stages;
+	uint32_t stage_count;
+};
+
+struct profile {
+	/** Open addressing table with linear probing. */
+	struct profile_line **lines;
+	/** Always a power of 2 or 0. */
+	uint32_t capacity;
+	uint32_t count;
+};
+
+double
+profile_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static double
+profile_timeval(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+void
+profile_usage_create(struct profile_usage *u, const struct rusage *ru,
+		     double real)
+{
+	u->real = real;
+	u->user = profile_timeval(&ru->ru_utime);
+	u->sys = profile_timeval(&ru->ru_stime);
+	u->max_rss = ru->ru_maxrss;
+	u->nvcsw = ru->ru_nvcsw;
+	u->nivcsw = ru->ru_nivcsw;
+}
+
+void
+profile_usage_sub(struct profile_usage *u, const struct profile_usage *before)
+{
+	u->real -= before->real;
+	u->user -= before->user;
+	u->sys -= before->sys;
+	u->nvcsw -= before->nvcsw;
+	u->nivcsw -= before->nivcsw;
+}
+
+void
+profile_usage_add(struct profile_usage *sum, const struct profile_usage *u)
+{
+	sum->real += u->real;
+	sum->user += u->user;
+	sum->sys += u->sys;
+	if (u->max_rss > sum->max_rss)
+		sum->max_rss = u->max_rss;
+	sum->nvcsw += u->nvcsw;
+	sum->nivcsw += u->nivcsw;
+}
+
+static uint32_t
+profile_hash(const char *str)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *str != 0; ++str) {
+		h ^= (unsigned char)*str;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+struct profile *
+profile_new(void)
+{
+	return calloc(1, sizeof(struct profile));
+}
+
+void
+profile_delete(struct profile *p)
+{
+	for (uint32_t i = 0; i < p->capacity; ++i) {
+		struct profile_line *l = p->lines[i];
+		if (l == NULL)
+			continue;
+		for (uint32_t j = 0; j < l->stage_count; ++j)
+			free(l->stages[j].name);
+		free(l->stages);
+		free(l->text);
+		free(l);
+	}
+	free(p->lines);
+	free(p);
+}
+
+static struct profile_line **
+profile_find_slot(const struct profile *p, const char *text)
+{
+	assert(p->capacity > 0);
+	uint32_t mask = p->capacity - 1;
+	uint32_t i = profile_hash(text) & mask;
+	while (p->lines[i] != NULL && strcmp(p->lines[i]->text, text) != 0)
+		i = (i + 1) & mask;
+	return &p->lines[i];
+}
+
+static void
+profile_grow(struct profile *p)
+{
+	struct profile_line **old = p->lines;
+	uint32_t old_capacity = p->capacity;
+	p->capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+	p->lines = calloc(p->capacity, sizeof(*p->lines));
+	for (uint32_t i = 0; i < old_capacity; ++i) {
+		if (old[i] != NULL)
+			*profile_find_slot(p, old[i]->text) = old[i];
+	}
+	free(old);
+}
+
+static struct profile_line *
+profile_line(struct profile *p, const char *text)
+{
+	if (p->count > 0) {
+		struct profile_line *l = *profile_find_slot(p, text);
+		if (l != NULL)
+			return l;
+	}
+	if ((p->count + 1) * 4 > p->capacity * 3)
+		profile_grow(p);
+	struct profile_line *l = calloc(1, sizeof(*l));
+	l->text = strdup(text);
+	*profile_find_slot(p, text) = l;
+	++p->count;
+	return l;
+}
+
+void
+profile_add_line(struct profile *p, const char *text, double real)
+{
+	struct profile_line *l = profile_line(p, text);
+	++l->count;
+	l->real += real;
+}
+
+void
+profile_add_stage(struct profile *p, const char *text, uint32_t index,
+		  const char *name, const struct profile_usage *u)
+{
+	struct profile_line *l = profile_line(p, text);
+	if (index >= l->stage_count) {
+		l->stages = realloc(l->stages, (index + 1) * sizeof(*l->stages));
+		memset(&l->stages[l->stage_count], 0,
+		       (index + 1 - l->stage_count) * sizeof(*l->stages));
+		l->stage_count = index + 1;
+	}
+	struct profile_stage *s = &l->stages[index];
+	if (s->name == NULL)
+		s->name = strdup(name);
+	++s->count;
+	profile_usage_add(&s->usage, u);
+}
+
+static int
+profile_line_cmp(const void *a, const void *b)
+{
+	const struct profile_line *la = *(const struct profile_line **)a;
+	const struct profile_line *lb = *(const struct profile_line **)b;
+	if (la->real != lb->real)
+		return la->real < lb->real ? 1 : -1;
+	return strcmp(la->text, lb->text);
+}
+
+static void
+profile_write_usage(FILE *f, uint64_t count, const struct profile_usage *u)
+{
+	fprintf(f, "%llu\t%.6f\t%.6f\t%.6f\t%ld\t%ld\t%ld",
+		(unsigned long long)count, u->real, u->user, u->sys, u->max_rss,
+		u->nvcsw, u->nivcsw);
+}
+
+int
+profile_write(const struct profile *p, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	/* A profile without lines has only the header. */
+	struct profile_line **lines = NULL;
+	uint32_t count = 0;
+	if (p->count > 0) {
+		lines = malloc(p->count * sizeof(*lines));
+		for (uint32_t i = 0; i < p->capacity; ++i) {
+			if (p->lines[i] != NULL)
+				lines[count++] = p->lines[i];
+		}
+		assert(count == p->count);
+		qsort(lines, count, sizeof(*lines), profile_line_cmp);
+	}
+	fprintf(f, "# runs\treal\tuser\tsys\tmaxrss_kb\tvcsw\tivcsw\t"
+		"line or its stage\n");
+	for (uint32_t i = 0; i < count; ++i) {
+		const struct profile_line *l = lines[i];
+		/* The line takes the wall time of its own, not of stages. */
+		struct profile_usage sum;
+		memset(&sum, 0, sizeof(sum));
+		for (uint32_t j = 0; j < l->stage_count; ++j)
+			profile_usage_add(&sum, &l->stages[j].usage);
+		sum.real = l->real;
+		profile_write_usage(f, l->count, &sum);
+		fprintf(f, "\t%s\n", l->text);
+		for (uint32_t j = 0; j < l->stage_count; ++j) {
+			const struct profile_stage *s = &l->stages[j];
+			if (s->name == NULL)
+				continue;
+			profile_write_usage(f, s->count, &s->usage);
+			fprintf(f, "\t  [%u] %s\n", j, s->name);
+		}
+	}
+	free(lines);
+	return fclose(f) == 0 ? 0 : -1;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+struct rusage;
+
+/** Resources used by a process or a sum of them. */
+struct profile_usage {
+	/** Wall clock time in seconds. */
+	double real;
+	/** CPU time in seconds. */
+	double user;
+	double sys;
+	/** Maximal resident set size in kilobytes. */
+	long max_rss;
+	/** Context switches: waits for a resource and preemptions. */
+	long nvcsw;
+	long nivcsw;
+};
+
+/** Monotonic time in seconds. */
+double
+profile_now(void);
+
+void
+profile_usage_create(struct profile_usage *u, const struct rusage *ru,
+		     double real);
+
+/**
+ * Turn the usage of a process into the usage since @a before, taken
+ * from the same process earlier. The memory stays the maximum.
+ */
+void
+profile_usage_sub(struct profile_usage *u, const struct profile_usage *before);
+
+/**
+ * Add @a u to @a sum. The times and switches are summed, the memory is
+ * the maximum of both.
+ */
+void
+profile_usage_add(struct profile_usage *sum, const struct profile_usage *u);
+
+/**
+ * Statistics of the executed command lines. Runs of the same line are
+ * summed up, and so are runs of each of its stages.
+ */
+struct profile;
+
+struct profile *
+profile_new(void);
+
+void
+profile_delete(struct profile *p);
+
+/** Account one run of the line @a text, which took @a real seconds. */
+void
+profile_add_line(struct profile *p, const char *text, double real);
+
+/**
+ * Account usage of the stage number @a index of the line @a text. The
+ * stages are numbered over the whole line, through all its pipelines.
+ */
+void
+profile_add_stage(struct profile *p, const char *text, uint32_t index,
+		  const char *name, const struct profile_usage *u);
+
+/**
+ * Write all the lines, the slowest first, each followed by its stages.
+ * @retval 0 Success.
+ * @retval -1 The file can't be written, errno is set.
+ */
+int
+profile_write(const struct profile *p, const char *path);
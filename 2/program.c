@@ -0,0 +1,125 @@
+#include "program.h"
+
+#include "parser.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t
+program_reserve_steps(struct program *prog, uint32_t count)
+{
+	if (prog->step_count + count > prog->step_capacity) {
+		uint32_t capacity = prog->step_capacity * 2;
+		if (capacity < prog->step_count + count)
+			capacity = prog->step_count + count;
+		prog->steps = realloc(prog->steps, capacity * sizeof(*prog->steps));
+		prog->step_capacity = capacity;
+	}
+	uint32_t first = prog->step_count;
+	prog->step_count += count;
+	return first;
+}
+
+static uint32_t
+program_add_stage(struct program *prog, const struct expr *e)
+{
+	if (prog->stage_count == prog->stage_capacity) {
+		prog->stage_capacity = (prog->stage_capacity + 1) * 2;
+		prog->stages = realloc(prog->stages, prog->stage_capacity *
+				       sizeof(*prog->stages));
+	}
+	struct program_stage *stage = &prog->stages[prog->stage_count];
+	stage->expr = e;
+	stage->body = PROGRAM_END;
+	return prog->stage_count++;
+}
+
+/**
+ * Compile one level of the tree: the expressions of the line or of a
+ * subshell.
+ * @return The first step of the level.
+ */
+static uint32_t
+program_compile_list(struct program *prog, const struct expr *head)
+{
+	assert(head != NULL);
+	uint32_t count = 1;
+	for (const struct expr *e = head; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_AND || e->type == EXPR_TYPE_OR)
+			++count;
+	}
+	/* The pipelines of one level are consecutive. */
+	uint32_t base = program_reserve_steps(prog, count);
+	/* Operator after each pipeline, PIPE for the last one. */
+	enum expr_type *ops = malloc(count * sizeof(*ops));
+	const struct expr *e = head;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t first = prog->stage_count;
+		for (; e != NULL && e->type != EXPR_TYPE_AND &&
+		     e->type != EXPR_TYPE_OR; e = e->next) {
+			if (e->type != EXPR_TYPE_PIPE)
+				program_add_stage(prog, e);
+		}
+		struct program_step *step = &prog->steps[base + i];
+		step->first_stage = first;
+		step->stage_count = prog->stage_count - first;
+		ops[i] = e != NULL ? e->type : EXPR_TYPE_PIPE;
+		if (e != NULL)
+			e = e->next;
+	}
+	/*
+	 * Going backwards, the pipelines right after the nearest following
+	 * '&&' and '||' are known. A failed '&&' skips everything until the
+	 * next '||', a succeeded '||' skips until the next '&&'.
+	 */
+	uint32_t after_and = PROGRAM_END;
+	uint32_t after_or = PROGRAM_END;
+	for (uint32_t i = count; i-- > 0;) {
+		struct program_step *step = &prog->steps[base + i];
+		switch (ops[i]) {
+		case EXPR_TYPE_AND:
+			step->next[0] = base + i + 1;
+			step->next[1] = after_or;
+			after_and = base + i + 1;
+			break;
+		case EXPR_TYPE_OR:
+			step->next[0] = after_and;
+			step->next[1] = base + i + 1;
+			after_or = base + i + 1;
+			break;
+		default:
+			step->next[0] = PROGRAM_END;
+			step->next[1] = PROGRAM_END;
+			break;
+		}
+	}
+	free(ops);
+	/* The bodies go after the whole level. */
+	uint32_t stage_end = prog->steps[base + count - 1].first_stage +
+			     prog->steps[base + count - 1].stage_count;
+	for (uint32_t i = prog->steps[base].first_stage; i < stage_end; ++i) {
+		const struct expr *stage = prog->stages[i].expr;
+		if (stage->type != EXPR_TYPE_SUBSHELL)
+			continue;
+		uint32_t body = program_compile_list(prog, stage->body);
+		prog->stages[i].body = body;
+	}
+	return base;
+}
+
+void
+program_create(struct program *prog, const struct command_line *line)
+{
+	memset(prog, 0, sizeof(*prog));
+	uint32_t first = program_compile_list(prog, line->head);
+	assert(first == 0);
+	(void)first;
+}
+
+void
+program_destroy(struct program *prog)
+{
+	free(prog->steps);
+	free(prog->stages);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+struct command_line;
+struct expr;
+
+/**
+ * Command line compiled into a flat array of pipelines. Each of them
+ * knows where to go after it succeeds or fails, and a subshell body is
+ * a range of the same array, so the executor is a plain loop over the
+ * steps on any level. It is a layout for the executor, not a speedup:
+ * a line is compiled every time it runs, and the cost of a line is in
+ * its parsing and forks anyway.
+ */
+
+enum {
+	/** Jump target meaning the end of the line or of a subshell. */
+	PROGRAM_END = UINT32_MAX,
+};
+
+/** Operand of a pipeline: a command or a subshell. */
+struct program_stage {
+	const struct expr *expr;
+	/** Valid for a subshell: the first step of its body. */
+	uint32_t body;
+};
+
+struct program_step {
+	/** The stages are consecutive in the stage array. */
+	uint32_t first_stage;
+	uint32_t stage_count;
+	/** Next step when the pipeline succeeded, [0], or failed, [1]. */
+	uint32_t next[2];
+};
+
+struct program {
+	struct program_step *steps;
+	uint32_t step_count;
+	uint32_t step_capacity;
+	struct program_stage *stages;
+	uint32_t stage_count;
+	uint32_t stage_capacity;
+};
+
+/**
+ * Compile the line. The top level starts at step 0, each subshell body
+ * is placed after the level containing it. The program refers to the
+ * expressions of the line, it must outlive the program.
+ */
+void
+program_create(struct program *prog, const struct command_line *line);
+
+void
+program_destroy(struct program *prog);
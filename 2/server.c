@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include "fd_copy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static int
+server_address(struct sockaddr_un *addr, const char *path)
+{
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/** Control message buffer of the passed descriptors. */
+union server_control {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int) * SERVER_FD_COUNT)];
+};
+
+static int
+server_recv_fds(int conn, int *fds)
+{
+	char byte;
+	struct iovec iov = {&byte, 1};
+	union server_control control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t rc;
+	do {
+		rc = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return -1;
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	if (c == NULL || c->cmsg_level != SOL_SOCKET ||
+	    c->cmsg_type != SCM_RIGHTS) {
+		errno = EPROTO;
+		return -1;
+	}
+	int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (rc != 1 || count != SERVER_FD_COUNT ||
+	    (msg.msg_flags & MSG_CTRUNC) != 0) {
+		for (int i = 0; i < count; ++i) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(fd));
+			close(fd);
+		}
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(c), sizeof(int) * SERVER_FD_COUNT);
+	return 0;
+}
+
+/** Replace stdin, stdout and stderr with the ones of the client. */
+static int
+server_install_fds(int conn)
+{
+	int fds[SERVER_FD_COUNT];
+	if (server_recv_fds(conn, fds) != 0)
+		return -1;
+	/*
+	 * The received descriptors can take the numbers 0-2 if the server
+	 * was started without them. Move them out of the way first.
+	 */
+	for (int i = 0; i < SERVER_FD_COUNT; ++i) {
+		if (fds[i] >= SERVER_FD_COUNT)
+			continue;
+		int fd = fcntl(fds[i], F_DUPFD_CLOEXEC, SERVER_FD_COUNT);
+		if (fd < 0)
+			return -1;
+		close(fds[i]);
+		fds[i] = fd;
+	}
+	for (int i = 0; i < SERVER_FD_COUNT; ++i) {
+		if (dup2(fds[i], i) < 0)
+			return -1;
+		close(fds[i]);
+	}
+	return 0;
+}
+
+/** Reap the finished scripts right when they end. */
+static void
+server_on_sigchld(int signo)
+{
+	(void)signo;
+	int err = errno;
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	errno = err;
+}
+
+int
+server_run(const char *path)
+{
+	struct sockaddr_un addr;
+	if (server_address(&addr, path) != 0)
+		return -1;
+	/*
+	 * A socket file left by a previous server is replaced. Any other
+	 * file is not ours to delete.
+	 */
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			errno = EADDRINUSE;
+			return -1;
+		}
+		unlink(path);
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, SOMAXCONN) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	/* The children get the handler of the shell back. */
+	struct sigaction sa, old_sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = server_on_sigchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, &old_sa);
+	while (true) {
+		int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			int err = errno;
+			sigaction(SIGCHLD, &old_sa, NULL);
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			sigaction(SIGCHLD, &old_sa, NULL);
+			close(fd);
+			if (server_install_fds(conn) != 0) {
+				perror("server");
+				server_reply(conn, 1);
+				_exit(1);
+			}
+			return conn;
+		}
+		if (pid < 0)
+			perror("fork");
+		close(conn);
+	}
+}
+
+void
+server_reply(int conn, int code)
+{
+	fflush(stdout);
+	fflush(stderr);
+	int32_t value = code;
+	/* The client could be gone, it must not kill the script. */
+	send(conn, &value, sizeof(value), MSG_NOSIGNAL);
+	close(conn);
+}
+
+static int
+server_send_fds(int conn)
+{
+	char byte = 0;
+	struct iovec iov = {&byte, 1};
+	union server_control control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int) * SERVER_FD_COUNT);
+	const int fds[SERVER_FD_COUNT] = {0, 1, 2};
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+	ssize_t rc;
+	do {
+		rc = sendmsg(conn, &msg, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+	return rc == 1 ? 0 : -1;
+}
+
+int
+server_client_run(const char *path, const char *script_path)
+{
+	struct sockaddr_un addr;
+	if (server_address(&addr, path) != 0)
+		return -1;
+	int script = open(script_path, O_RDONLY | O_CLOEXEC);
+	if (script < 0)
+		return -1;
+	int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn < 0)
+		goto error;
+	if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    server_send_fds(conn) != 0 || fd_copy(script, conn) != 0 ||
+	    shutdown(conn, SHUT_WR) != 0)
+		goto error;
+	close(script);
+	script = -1;
+	int32_t value;
+	size_t size = 0;
+	while (size < sizeof(value)) {
+		ssize_t rc = read(conn, (char *)&value + size,
+				  sizeof(value) - size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			if (rc == 0)
+				errno = ECONNRESET;
+			goto error;
+		}
+		size += rc;
+	}
+	close(conn);
+	return value;
+error:;
+	int err = errno;
+	if (script >= 0)
+		close(script);
+	if (conn >= 0)
+		close(conn);
+	errno = err;
+	return -1;
+}
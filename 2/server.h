@@ -0,0 +1,50 @@
+#pragma once
+
+/**
+ * Shell server on a UNIX socket. The server process is a template:
+ * each script is run in a child forked from it, so the startup of the
+ * shell is paid only once. So is the state prepared by the start
+ * script of the server, like the command path hash filled with
+ * 'hash name...'.
+ *
+ * The protocol of one connection:
+ * - The client sends one byte with its stdin, stdout and stderr
+ *   attached as SCM_RIGHTS. The script runs with them.
+ * - The client sends the script text and shuts down the writing.
+ * - The server replies with the exit code of the script, a 32 bit
+ *   integer in the host byte order, and closes the connection.
+ */
+
+/** Order of the descriptors passed with a script. */
+enum {
+	SERVER_FD_COUNT = 3,
+};
+
+/**
+ * Listen on @a path and fork a child per accepted connection. The
+ * finished children are reaped on SIGCHLD. Returns only in a child,
+ * with the client descriptors installed as 0, 1 and 2 and the SIGCHLD
+ * handler of the caller restored. The script is to be read from the returned connection, and the
+ * exit code is to be sent to it with server_reply().
+ * @retval >= 0 Connection in a child.
+ * @retval -1 The server failed, errno is set. It is EADDRINUSE if
+ *         @a path is a file other than a socket, which is left alone.
+ */
+int
+server_run(const char *path);
+
+/**
+ * Send the exit code of the script to the client. Pending output is
+ * flushed first, so the client sees it before the reply.
+ */
+void
+server_reply(int conn, int code);
+
+/**
+ * Run the script @a script_path on the server at @a path, passing the
+ * current stdin, stdout and stderr to it.
+ * @retval >= 0 Exit code of the script.
+ * @retval -1 Error, errno is set.
+ */
+int
+server_client_run(const char *path, const char *script_path);
@@ -0,0 +1,95 @@
+import subprocess
+import argparse
+import tempfile
+import time
+import sys
+import os
+
+parser = argparse.ArgumentParser(description='Tests for the shell server')
+parser.add_argument('-e', type=str, default='./a.out',
+		    help='executable shell file')
+args = parser.parse_args()
+
+workdir = tempfile.mkdtemp()
+sock = os.path.join(workdir, 'sock')
+server = None
+
+def finish(code):
+	if server is not None:
+		server.kill()
+		server.wait()
+	os.system('rm -rf {}'.format(workdir))
+	sys.exit(code)
+
+def write_file(name, text):
+	path = os.path.join(workdir, name)
+	with open(path, 'w') as f:
+		f.write(text)
+	return path
+
+def check(cond, msg):
+	if not cond:
+		print('Error: {}'.format(msg))
+		print('The tests did not pass')
+		finish(-1)
+
+def run_client(script):
+	path = write_file('script', script)
+	p = subprocess.run([args.e, '--connect', sock, path],
+			   stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+			   stdin=subprocess.DEVNULL, timeout=3)
+	return p.stdout.decode(), p.returncode
+
+def server_children():
+	path = '/proc/{0}/task/{0}/children'.format(server.pid)
+	with open(path) as f:
+		return f.read().split()
+
+# Only a socket left by a previous server is replaced.
+victim = write_file('victim.txt', 'data')
+p = subprocess.run([args.e, '--server', victim], stdout=subprocess.PIPE,
+		   stderr=subprocess.STDOUT, timeout=3)
+check(p.returncode != 0, 'the server started over a regular file')
+with open(victim) as f:
+	check(f.read() == 'data', 'the regular file is changed')
+
+# The start script fills the command hash before the children fork.
+start = write_file('start', 'hash sort')
+server = subprocess.Popen([args.e, '--server', sock, start])
+for _ in range(100):
+	if os.path.exists(sock):
+		break
+	time.sleep(0.01)
+check(os.path.exists(sock), 'the server does not listen')
+
+out, code = run_client('hash\n')
+check('sort' in out, 'the start script state is not inherited: ' + out)
+
+out, code = run_client('echo 1 | cat\necho 2 > /dev/stderr\n')
+check(out == '1\n2\n', 'wrong output: ' + out)
+check(code == 0, 'wrong exit code {}'.format(code))
+
+out, code = run_client('echo a\necho b')
+check(out == 'a\nb\n', 'the last line without a new line is lost: ' + out)
+
+out, code = run_client('echo c\nexit 7\necho d\n')
+check(out == 'c\n', 'exit does not stop the script: ' + out)
+check(code == 7, 'wrong exit code {}'.format(code))
+
+clients = [subprocess.Popen([args.e, '--connect', sock,
+			     write_file('script{}'.format(i),
+					'sleep 0.2\nexit {}\n'.format(i))],
+			    stdin=subprocess.DEVNULL)
+	   for i in range(4)]
+for i, c in enumerate(clients):
+	check(c.wait(3) == i, 'wrong exit code of a parallel script')
+
+# Finished scripts are reaped without waiting for a new connection.
+for _ in range(100):
+	if len(server_children()) == 0:
+		break
+	time.sleep(0.01)
+check(len(server_children()) == 0, 'the finished scripts are not reaped')
+
+print('The tests passed')
+finish(0)
@@ -1,208 +1,1109 @@
+#define _GNU_SOURCE
+
+#include "command_hash.h"
+#include "fd_copy.h"
+#include "job_table.h"
+#include "parallel.h"
 #include "parser.h"
+#include "profile.h"
+#include "program.h"
+#include "server.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
-void wait_bg(pid_t * bg_pids, int * bg_num, int opts) {
-	int i;
-	for (i = 0; i < *bg_num; )
-		if (waitpid(bg_pids[i], NULL, opts)) {
-			int j;
-			for (j = i+1; j < *bg_num; j++)
-				bg_pids[j-1] = bg_pids[j];
-			(*bg_num)--;
-		} else
-			i++;
+extern char **environ;
+
+/** Settings changed by the 'shellopt' builtin. */
+struct shell_options {
+	/** Size of pipe buffers between pipeline stages, 0 is default. */
+	int pipe_size;
+	/** Whether to pin each pipeline stage to its own CPU. */
+	bool pin_cpus;
+	/** Statistics of the executed lines, NULL if not collected. */
+	struct profile *profile;
+	/** File to write the statistics to when profiling ends. */
+	char *profile_path;
+};
+
+/** Builtins which run in a child process like usual commands. */
+static bool
+is_forked_builtin(const char *name)
+{
+	return strcmp(name, "parallel") == 0;
 }
 
-static int execute_command_line(const struct command_line *line, int * exit_flag, pid_t ** pbg_pids, int * bg_num)
+/**
+ * Builtins which only move data: 'cat' and 'tee -a'. They don't need a
+ * process of their own, and the data goes between pipes and files
+ * without being copied into the user space.
+ */
+static bool
+is_copy_builtin(char **argv)
 {
-	/* REPLACE THIS CODE WITH ACTUAL COMMAND EXECUTION */
-	assert(line != NULL);
-	pid_t tid = -1;
+	bool is_tee = strcmp(argv[0], "tee") == 0;
+	if (!is_tee && strcmp(argv[0], "cat") != 0)
+		return false;
+	/*
+	 * Options can go after the files too. Any option the builtins
+	 * don't implement, including '--' and the long ones, makes the
+	 * external program run instead.
+	 */
+	for (int i = 1; argv[i] != NULL; ++i) {
+		bool is_option = argv[i][0] == '-' && argv[i][1] != 0;
+		if (is_option && !(is_tee && strcmp(argv[i], "-a") == 0))
+			return false;
+	}
+	return true;
+}
 
-	wait_bg(*pbg_pids, bg_num, WNOHANG);
+/**
+ * Descriptors of a builtin: stdin, stdout and stderr. Builtins run in
+ * the shell process get their redirections opened separately, so the
+ * shell's own 0, 1 and 2 are never replaced and restored.
+ */
+struct builtin_io {
+	int fds[3];
+	/** Which of the descriptors were opened for the builtin. */
+	bool is_owned[3];
+};
 
-	if ((int)line->is_background) {
-		tid = fork();
-		if (tid == 0) {
-			*bg_num = 0;
+/**
+ * Open the source or the destination of a redirection. The descriptor
+ * is close-on-exec, so it never leaks into other commands.
+ * @retval >= 0 Descriptor.
+ * @retval -1 Error, it is reported.
+ */
+static int
+redirect_open(const struct redirect *r)
+{
+	int fd = -1;
+	switch (r->type) {
+	case REDIRECT_TYPE_FILE_READ:
+		fd = open(r->target, O_RDONLY | O_CLOEXEC);
+		break;
+	case REDIRECT_TYPE_FILE_NEW:
+		fd = open(r->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			  0666);
+		break;
+	case REDIRECT_TYPE_FILE_APPEND:
+		fd = open(r->target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+			  0666);
+		break;
+	case REDIRECT_TYPE_HERE_STRING: {
+		/* A file in memory can be of any size, unlike a pipe. */
+		fd = memfd_create("here-string", MFD_CLOEXEC);
+		if (fd < 0)
+			break;
+		size_t len = strlen(r->target);
+		if (write(fd, r->target, len) != (ssize_t)len ||
+		    write(fd, "\n", 1) != 1 || lseek(fd, 0, SEEK_SET) != 0) {
+			close(fd);
+			fd = -1;
+		}
+		break;
+	}
+	default:
+		assert(false);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n",
+			r->type == REDIRECT_TYPE_HERE_STRING ? "here-string" :
+			r->target, strerror(errno));
+	}
+	return fd;
+}
+
+/**
+ * Apply the redirections of a command in its child process, after its
+ * pipes and the output file are in place. Dies if a file can't be
+ * opened.
+ */
+static void
+redirects_apply(const struct redirect *r)
+{
+	for (; r != NULL; r = r->next) {
+		if (r->type == REDIRECT_TYPE_STDOUT) {
+			dup2(STDOUT_FILENO, r->fd);
+			continue;
+		}
+		int fd = redirect_open(r);
+		if (fd < 0)
+			_exit(1);
+		dup2(fd, r->fd);
+		close(fd);
+	}
+}
+
+static void
+builtin_io_set(struct builtin_io *io, int i, int fd, bool is_owned)
+{
+	if (io->is_owned[i])
+		close(io->fds[i]);
+	io->fds[i] = fd;
+	io->is_owned[i] = is_owned;
+}
+
+static void
+builtin_io_close(struct builtin_io *io)
+{
+	for (int i = 0; i < 3; ++i)
+		builtin_io_set(io, i, -1, false);
+}
+
+/**
+ * Make the descriptors for a builtin in the shell process with the
+ * given stdin and stdout and the redirections of the command.
+ * @retval 0 Success.
+ * @retval -1 A redirection failed, it is reported. Nothing to close.
+ */
+static int
+builtin_io_open(struct builtin_io *io, int in, int out,
+		const struct redirect *r)
+{
+	memset(io, 0, sizeof(*io));
+	io->fds[0] = in;
+	io->fds[1] = out;
+	io->fds[2] = STDERR_FILENO;
+	for (; r != NULL; r = r->next) {
+		if (r->type == REDIRECT_TYPE_STDOUT) {
+			builtin_io_set(io, r->fd, io->fds[1], false);
+			continue;
+		}
+		int fd = redirect_open(r);
+		if (fd < 0) {
+			builtin_io_close(io);
+			return -1;
+		}
+		builtin_io_set(io, r->fd, fd, true);
+	}
+	return 0;
+}
+
+/**
+ * Copy a file or stdin if @a name is NULL or "-" to stdout.
+ * @retval 0 Success.
+ * @retval -1 Error, it is reported and errno is set.
+ */
+static int
+cat_file(const int *fds, const char *name)
+{
+	int fd = fds[0];
+	if (name == NULL)
+		name = "-";
+	else if (strcmp(name, "-") != 0)
+		fd = open(name, O_RDONLY | O_CLOEXEC);
+	int rc = fd < 0 ? -1 : 0;
+	struct stat in_st, out_st;
+	/*
+	 * Like cat(1), refuse to append a file to itself unless its rest
+	 * is empty: the copy would read its own output forever.
+	 */
+	if (rc == 0 && fstat(fd, &in_st) == 0 && fstat(fds[1], &out_st) == 0 &&
+	    S_ISREG(out_st.st_mode) && in_st.st_dev == out_st.st_dev &&
+	    in_st.st_ino == out_st.st_ino &&
+	    lseek(fd, 0, SEEK_CUR) < out_st.st_size) {
+		dprintf(fds[2], "cat: %s: input file is output file\n", name);
+		if (fd != fds[0])
+			close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if (rc == 0)
+		rc = fd_copy(fd, fds[1]);
+	int err = errno;
+	/* A closed reader would kill an external cat silently. */
+	if (rc != 0 && err != EPIPE)
+		dprintf(fds[2], "cat: %s: %s\n", name, strerror(err));
+	if (fd >= 0 && fd != fds[0])
+		close(fd);
+	errno = err;
+	return rc;
+}
+
+static int
+builtin_cat(const int *fds, char **argv)
+{
+	if (argv[1] == NULL)
+		return cat_file(fds, NULL) != 0;
+	int rc = 0;
+	for (int i = 1; argv[i] != NULL; ++i) {
+		if (cat_file(fds, argv[i]) != 0) {
+			rc = 1;
+			/* Nobody reads the output anymore. */
+			if (errno == EPIPE)
+				break;
+		}
+	}
+	return rc;
+}
+
+static int
+builtin_tee(const int *fds, char **argv)
+{
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+	int count = 0;
+	for (int i = 1; argv[i] != NULL; ++i) {
+		if (strcmp(argv[i], "-a") == 0)
+			flags = (flags & ~O_TRUNC) | O_APPEND;
+		else
+			++count;
+	}
+	int *files = malloc((count + 1) * sizeof(*files));
+	int *opened = malloc((count + 1) * sizeof(*opened));
+	char **names = malloc((count + 1) * sizeof(*names));
+	int rc = 0;
+	count = 0;
+	for (int i = 1; argv[i] != NULL; ++i) {
+		if (strcmp(argv[i], "-a") == 0)
+			continue;
+		int fd = open(argv[i], flags, 0666);
+		if (fd < 0) {
+			dprintf(fds[2], "tee: %s: %s\n", argv[i],
+				strerror(errno));
+			rc = 1;
+			continue;
+		}
+		names[count] = argv[i];
+		opened[count] = fd;
+		files[count++] = fd;
+	}
+	if (fd_tee(fds[0], fds[1], files, count) != 0) {
+		if (errno != EPIPE)
+			dprintf(fds[2], "tee: %s\n", strerror(errno));
+		rc = 1;
+	}
+	for (int i = 0; i < count; ++i) {
+		if (files[i] < 0) {
+			dprintf(fds[2], "tee: %s: write error\n", names[i]);
+			rc = 1;
+		}
+		close(opened[i]);
+	}
+	free(files);
+	free(opened);
+	free(names);
+	return rc;
+}
+
+/** @a fds are stdin, stdout and stderr of the builtin. */
+static int
+run_copy_builtin(const int *fds, char **argv)
+{
+	if (strcmp(argv[0], "cat") == 0)
+		return builtin_cat(fds, argv);
+	return builtin_tee(fds, argv);
+}
+
+/**
+ * Run a copy builtin in the shell process itself. A closed reader of
+ * the output must not kill the shell, so SIGPIPE is ignored meanwhile,
+ * and the builtin just fails with EPIPE.
+ */
+static int
+run_copy_builtin_in_shell(int in, int out, const struct redirect *r,
+			  char **argv)
+{
+	struct builtin_io io;
+	if (builtin_io_open(&io, in, out, r) != 0)
+		return 1;
+	struct sigaction ignore, old;
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGPIPE, &ignore, &old);
+	int rc = run_copy_builtin(io.fds, argv);
+	sigaction(SIGPIPE, &old, NULL);
+	builtin_io_close(&io);
+	return rc;
+}
+
+/**
+ * Replace the current child process with the command found by the
+ * shell. When the command can't be started, the child dies with the
+ * same code as in the other shells.
+ */
+static void
+exec_command(const char *path, char **argv, struct command_hash *hash)
+{
+	if (is_forked_builtin(argv[0]))
+		_exit(parallel_run(argv + 1, hash, exec_command));
+	if (is_copy_builtin(argv)) {
+		int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+		_exit(run_copy_builtin(fds, argv));
+	}
+	if (path == NULL) {
+		fprintf(stderr, "%s: command not found\n", argv[0]);
+		_exit(127);
+	}
+	execve(path, argv, environ);
+	int err = errno;
+	if (err == ENOEXEC) {
+		/* A script without '#!' is run by sh, like execvp() does. */
+		int argc = 0;
+		while (argv[argc] != NULL)
+			++argc;
+		char **sh_argv = malloc((argc + 2) * sizeof(*sh_argv));
+		sh_argv[0] = (char *) "sh";
+		sh_argv[1] = (char *) path;
+		memcpy(sh_argv + 2, argv + 1, argc * sizeof(*sh_argv));
+		execve("/bin/sh", sh_argv, environ);
+		err = errno;
+	}
+	errno = err;
+	perror(argv[0]);
+	/* The hashed binary could be removed since the lookup. */
+	_exit(err == ENOENT ? 127 : 126);
+}
+
+static void
+shell_options_start_profile(struct shell_options *options, const char *path)
+{
+	assert(options->profile == NULL);
+	options->profile = profile_new();
+	options->profile_path = strdup(path);
+}
+
+/**
+ * Write the collected statistics and stop profiling.
+ * @retval 0 Success or profiling was off.
+ * @retval -1 The file can't be written, it is reported.
+ */
+static int
+shell_options_stop_profile(struct shell_options *options)
+{
+	if (options->profile == NULL)
+		return 0;
+	int rc = profile_write(options->profile, options->profile_path);
+	if (rc != 0) {
+		fprintf(stderr, "%s: %s\n", options->profile_path,
+			strerror(errno));
+	}
+	profile_delete(options->profile);
+	free(options->profile_path);
+	options->profile = NULL;
+	options->profile_path = NULL;
+	return rc;
+}
+
+/** Forked copies of the shell leave the profile to the shell itself. */
+static void
+shell_options_drop_profile(struct shell_options *options)
+{
+	if (options->profile == NULL)
+		return;
+	profile_delete(options->profile);
+	free(options->profile_path);
+	options->profile = NULL;
+	options->profile_path = NULL;
+}
+
+static void
+expr_list_print(FILE *f, const struct expr *e)
+{
+	static const char *redirect_ops[] = {
+		[REDIRECT_TYPE_FILE_READ] = "<",
+		[REDIRECT_TYPE_FILE_NEW] = "2>",
+		[REDIRECT_TYPE_FILE_APPEND] = "2>>",
+		[REDIRECT_TYPE_STDOUT] = "2>&1",
+		[REDIRECT_TYPE_HERE_STRING] = "<<<",
+	};
+	for (; e != NULL; e = e->next) {
+		switch (e->type) {
+		case EXPR_TYPE_COMMAND:
+			fputs(e->cmd.exe, f);
+			for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+				fprintf(f, " %s", e->cmd.args[i]);
+			break;
+		case EXPR_TYPE_SUBSHELL:
+			fputs("(", f);
+			expr_list_print(f, e->body);
+			fputs(")", f);
+			break;
+		case EXPR_TYPE_PIPE:
+			fputs(" | ", f);
+			break;
+		case EXPR_TYPE_AND:
+			fputs(" && ", f);
+			break;
+		case EXPR_TYPE_OR:
+			fputs(" || ", f);
+			break;
+		}
+		for (const struct redirect *r = e->cmd.redirects; r != NULL;
+		     r = r->next) {
+			fprintf(f, " %s", redirect_ops[r->type]);
+			if (r->target != NULL)
+				fprintf(f, " %s", r->target);
+		}
+	}
+}
+
+/**
+ * Text of the line for the profile. Runs of the same text are summed
+ * up there.
+ */
+static char *
+command_line_text(const struct command_line *line)
+{
+	char *text = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&text, &size);
+	expr_list_print(f, line->head);
+	if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+		fprintf(f, " > %s", line->out_file);
+	else if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+		fprintf(f, " >> %s", line->out_file);
+	if (line->is_background)
+		fputs(" &", f);
+	fclose(f);
+	return text;
+}
+
+/**
+ * Number of the command or subshell on the top level of the line, the
+ * same for each run.
+ */
+static uint32_t
+command_line_stage_index(const struct command_line *line,
+			 const struct expr *stage)
+{
+	uint32_t index = 0;
+	for (const struct expr *e = line->head; e != stage; e = e->next) {
+		if (e->type == EXPR_TYPE_COMMAND ||
+		    e->type == EXPR_TYPE_SUBSHELL)
+			++index;
+	}
+	return index;
+}
+
+/** Print resources used by a pipeline like bash 'time' does. */
+static void
+print_time(const struct profile_usage *u)
+{
+	const char *names[] = {"real", "user", "sys"};
+	double values[] = {u->real, u->user, u->sys};
+	fprintf(stderr, "\n");
+	for (int i = 0; i < 3; ++i) {
+		int minutes = values[i] / 60;
+		fprintf(stderr, "%s\t%dm%.3fs\n", names[i], minutes,
+			values[i] - minutes * 60);
+	}
+	fprintf(stderr, "maxrss\t%ldKB\n", u->max_rss);
+	fprintf(stderr, "csw\t%ld voluntary, %ld involuntary\n", u->nvcsw,
+		u->nivcsw);
+}
+
+/** Usage of the shell process itself, for the stages run in it. */
+static void
+self_usage(struct profile_usage *u)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	profile_usage_create(u, &ru, profile_now());
+}
+
+/**
+ * Account a finished stage in the usage of its pipeline and in the
+ * profile if it is on.
+ */
+static void
+account_stage(struct shell_options *options, const struct command_line *line,
+	      const char *line_text, const struct expr *stage,
+	      const char *name, const struct profile_usage *u,
+	      struct profile_usage *pipeline)
+{
+	profile_usage_add(pipeline, u);
+	if (options->profile != NULL && line_text != NULL) {
+		profile_add_stage(options->profile, line_text,
+				  command_line_stage_index(line, stage), name, u);
+	}
+}
+
+/**
+ * Limit of the pipe size for unprivileged users. Bigger sizes fail
+ * with EPERM.
+ */
+static int
+pipe_max_size(void)
+{
+	int res = 1024 * 1024;
+	FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%d", &res) != 1)
+			res = 1024 * 1024;
+		fclose(f);
+	}
+	return res;
+}
+
+/**
+ * Builtin 'shellopt [option value]'. Without arguments prints all the
+ * options. The name is not 'set' to keep that one for the POSIX shell
+ * options. The options are:
+ * - pipesize N - buffer size of the pipes between pipeline stages in
+ *   bytes. Bigger buffers mean less context switches between stages
+ *   which move a lot of data. 0 keeps the system default. The size is
+ *   capped by /proc/sys/fs/pipe-max-size.
+ * - pincpu on|off - run the stages of a pipeline each on its own CPU
+ *   out of the ones allowed for the shell.
+ * - profile file|off - collect time and resources used by each line
+ *   and each of its commands. They are written to the file when the
+ *   profiling is turned off or the shell exits.
+ */
+static int
+builtin_shellopt(const struct command *cmd, struct shell_options *options,
+		 const int *fds)
+{
+	if (cmd->arg_count == 0) {
+		dprintf(fds[1], "pipesize %d\n", options->pipe_size);
+		dprintf(fds[1], "pincpu %s\n", options->pin_cpus ? "on" : "off");
+		dprintf(fds[1], "profile %s\n", options->profile != NULL ?
+			options->profile_path : "off");
+		return 0;
+	}
+	const char *value = cmd->arg_count == 2 ? cmd->args[1] : "";
+	if (strcmp(cmd->args[0], "pipesize") == 0 && cmd->arg_count == 2) {
+		char *end;
+		long size = strtol(value, &end, 10);
+		if (*end == 0 && size >= 0 && end != value) {
+			int max = pipe_max_size();
+			options->pipe_size = size > max ? max : size;
+			return 0;
+		}
+	} else if (strcmp(cmd->args[0], "pincpu") == 0) {
+		if (strcmp(value, "on") == 0 || strcmp(value, "off") == 0) {
+			options->pin_cpus = strcmp(value, "on") == 0;
+			return 0;
+		}
+	} else if (strcmp(cmd->args[0], "profile") == 0 && *value != 0) {
+		int rc = shell_options_stop_profile(options);
+		if (strcmp(value, "off") != 0)
+			shell_options_start_profile(options, value);
+		return rc;
+	}
+	dprintf(fds[2], "usage: shellopt [pipesize bytes | pincpu on|off | "
+		"profile file|off]\n");
+	return 1;
+}
+
+/**
+ * Builtin 'hash [-r | name...]'. Without arguments prints the
+ * remembered commands, '-r' forgets them, names are searched and
+ * remembered.
+ */
+static int
+builtin_hash(const struct command *cmd, struct command_hash *hash,
+	     const int *fds)
+{
+	if (cmd->arg_count == 0) {
+		command_hash_print(hash, fds[1]);
+		return 0;
+	}
+	if (cmd->arg_count == 1 && strcmp(cmd->args[0], "-r") == 0) {
+		command_hash_clear(hash);
+		return 0;
+	}
+	int rc = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		if (command_hash_lookup(hash, cmd->args[i]) == NULL) {
+			dprintf(fds[2], "hash: %s: not found\n", cmd->args[i]);
+			rc = 1;
+		}
+	}
+	return rc;
+}
+
+/**
+ * Bind the current process to the CPU number @a index among the ones
+ * the process is allowed to run on, wrapping around.
+ */
+static void
+pin_to_cpu(int index)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	int count = CPU_COUNT(&allowed);
+	if (count <= 1)
+		return;
+	index %= count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed) || index-- > 0)
+			continue;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+		return;
+	}
+}
+
+/** State of the command line being executed. */
+struct line_run {
+	const struct command_line *line;
+	struct program program;
+	int * exit_flag;
+	struct job_table *jobs;
+	struct command_hash *hash;
+	struct shell_options *options;
+	/** Stdout of the last stage of each pipeline. */
+	int output;
+	/** Text of the line for the profile, NULL if not profiled. */
+	char *text;
+};
+
+static int run_program(struct line_run *run, uint32_t pc, int ret_code);
+
+/**
+ * Body of a subshell in its forked child. The stdin and stdout are
+ * already set up like for any other stage of a pipeline.
+ */
+static void run_subshell(struct line_run *run, uint32_t body, int ret_code)
+{
+	int exit_flag = 0;
+	job_table_clear(run->jobs);
+	shell_options_drop_profile(run->options);
+	free(run->text);
+	run->text = NULL;
+	run->exit_flag = &exit_flag;
+	run->output = STDOUT_FILENO;
+	_exit(run_program(run, body, ret_code));
+}
+
+static int run_pipeline(struct line_run *run, const struct program_step *step, int ret_code)
+{
+	struct shell_options *options = run->options;
+	struct command_hash *hash = run->hash;
+	int output = run->output;
+	int to_child[2] = { STDIN_FILENO };
+	int n_processes = 0;
+	int has_ret_code = 0;
+	int i;
+	pid_t * ids = NULL;
+	char *** args = NULL;
+	/* Start times and expressions of the forked stages. */
+	double *starts = NULL;
+	const struct expr **stages = NULL;
+	const struct program_stage *first = &run->program.stages[step->first_stage];
+	const struct expr *e = first->expr;
+	/*
+	 * 'time' prefix of the pipeline is not a command, the
+	 * rest of its arguments is. Before a subshell the parser
+	 * marks the subshell instead.
+	 */
+	const struct expr *timed = NULL;
+	struct command timed_cmd;
+	if (e->type == EXPR_TYPE_SUBSHELL && e->is_timed) {
+		timed = e;
+		timed_cmd = e->cmd;
+	} else if (e->type == EXPR_TYPE_COMMAND && strcmp(e->cmd.exe, "time") == 0) {
+		timed = e;
+		timed_cmd = e->cmd;
+		/* Bare 'time' measures nothing. */
+		timed_cmd.exe = e->cmd.arg_count > 0 ? e->cmd.args[0] : NULL;
+		timed_cmd.args = e->cmd.args + 1;
+		timed_cmd.arg_count = e->cmd.arg_count > 0 ? e->cmd.arg_count - 1 : 0;
+	}
+	bool is_measured = timed != NULL || options->profile != NULL;
+	struct profile_usage usage;
+	memset(&usage, 0, sizeof(usage));
+	double pipeline_start = is_measured ? profile_now() : 0;
+	for (uint32_t s = 0; s < step->stage_count && !(*run->exit_flag); ++s) {
+		const struct program_stage *stage = &first[s];
+		bool is_last = s + 1 == step->stage_count;
+		e = stage->expr;
+		bool is_subshell = e->type == EXPR_TYPE_SUBSHELL;
+		const struct command *cmd = e == timed ? &timed_cmd : &e->cmd;
+		const char *name = is_subshell ? "(...)" : cmd->exe;
+		if (name == NULL) {
+			ret_code = 0;
+		} else if (strcmp(name, "cd") == 0) {
+			if (cmd->arg_count != 1)
+				ret_code = 1;
+			else {
+				ret_code = chdir(cmd->args[0]);
+			}
+		} else if (strcmp(name, "hash") == 0 ||
+			   strcmp(name, "shellopt") == 0) {
+			struct builtin_io io;
+			ret_code = 1;
+			if (builtin_io_open(&io, STDIN_FILENO, output, cmd->redirects) == 0) {
+				if (name[0] == 'h')
+					ret_code = builtin_hash(cmd, hash, io.fds);
+				else
+					ret_code = builtin_shellopt(cmd, options, io.fds);
+				builtin_io_close(&io);
+			}
+		} else if (strcmp(name, "wait") == 0) {
+			job_table_wait_all(run->jobs);
+			ret_code = 0;
+		} else if (strcmp(name, "exit") == 0) {
+			/* Does nothing in the middle of a pipeline. */
+			if (is_last) {
+				if (cmd->arg_count == 1)
+					ret_code = atoi(cmd->args[0]);
+				if (n_processes == 0)
+					*run->exit_flag = 1;
+				else
+					has_ret_code = 1;
+			}
 		} else {
-			*pbg_pids = (pid_t *) realloc(*pbg_pids, ((*bg_num)+1)*sizeof(pid_t));
-			(*pbg_pids)[*bg_num] = tid;
-			(*bg_num)++;
-		}
-	}
-
-	if (tid <= 0) {
-		int old_stdout = dup(STDOUT_FILENO);
-		int output = STDOUT_FILENO;
-		if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-			output = open(line->out_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-			dup2(output, STDOUT_FILENO);
-		} else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-			output = open(line->out_file, O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
-			dup2(output, STDOUT_FILENO);
-		}
-		const struct expr *e = line->head;
-		pid_t * ids = NULL;
-		char *** args = NULL;
-		int ret_code = 0;
-		while (!(*exit_flag) && e != NULL) {
-			int to_child[2] = { STDIN_FILENO };
-			int n_processes = 0;
-			int has_ret_code = 0;
-			int i;
-			while (!(*exit_flag) && e != NULL && e->type == EXPR_TYPE_COMMAND) {
-				if (strcmp(e->cmd.exe, "cd") == 0) {
-					if (e->cmd.arg_count != 1)
-						ret_code = 1;
-					else {
-						ret_code = chdir(e->cmd.args[0]);
-					}
-				} else if (strcmp(e->cmd.exe, "exit") == 0) {
-					if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-						// Perform nothing
-						if (e->next && e->next->type == EXPR_TYPE_PIPE) e = e->next;
-					} else {
-						if (e->cmd.arg_count == 1)
-							ret_code = atoi(e->cmd.args[0]);
-						if (n_processes == 0)
-							*exit_flag = 1;
-						else
-							has_ret_code = 1;
-					}
-				} else {
-					args = (char ***) realloc(args, (n_processes+1)*sizeof(char **));
-					args[n_processes] = (char **) malloc((e->cmd.arg_count+3)*sizeof(char *));
-					args[n_processes][0] = e->cmd.exe;
-					args[n_processes][1] = e->cmd.exe;
-
-					for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
-						args[n_processes][i+2] = e->cmd.args[i];
-					}
-					args[n_processes][e->cmd.arg_count+2] = NULL;
-
-					n_processes++;
-					ids = (pid_t *) realloc(ids, n_processes*sizeof(pid_t));
-					pid_t id = 0;
-					if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-						int old_in = to_child[0];
-						pipe(to_child);
-						id = fork();
-						if (id == 0) {
-							if (old_in != STDIN_FILENO) {
-								dup2(old_in, STDIN_FILENO);
-								close(old_in);
-							}
-							dup2(to_child[1], STDOUT_FILENO);
-							close(to_child[0]);
-							close(to_child[1]);
-							execvp(args[n_processes-1][0], &args[n_processes-1][1]);
-						}
-						if (old_in != STDIN_FILENO) {
-							close(old_in);
-						}
-						close(to_child[1]);
-						e = e->next;
-					} else {
-						id = fork();
-						if (id == 0) {
-							if (to_child[0] != STDIN_FILENO) {
-								dup2(to_child[0], STDIN_FILENO);
-								close(to_child[0]);
-							}
-							execvp(args[n_processes-1][0], &args[n_processes-1][1]);
-						}
-						if (to_child[0] != STDIN_FILENO) {
-							close(to_child[0]);
-						}
-					}
-					ids[n_processes-1] = id;
-				}
-				e = e->next;
+			args = (char ***) realloc(args, (n_processes+1)*sizeof(char **));
+			args[n_processes] = (char **) malloc((cmd->arg_count+3)*sizeof(char *));
+			args[n_processes][1] = (char *) name;
+
+			for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+				args[n_processes][i+2] = cmd->args[i];
 			}
-			for (i = 0; i < n_processes; i++) {
-				int status = 0;
-				pid_t id = wait(&status);
-				if (!has_ret_code && id == ids[n_processes-1])
-					ret_code = WEXITSTATUS(status);
+			args[n_processes][cmd->arg_count+2] = NULL;
+
+			bool is_copy = !is_subshell && is_copy_builtin(&args[n_processes][1]);
+			if (is_copy && is_last) {
+				/* The last stage reads the pipe right in the shell. */
+				struct profile_usage self;
+				if (is_measured)
+					self_usage(&self);
+				ret_code = run_copy_builtin_in_shell(to_child[0], output, cmd->redirects, &args[n_processes][1]);
+				if (is_measured) {
+					struct profile_usage before = self;
+					self_usage(&self);
+					profile_usage_sub(&self, &before);
+					account_stage(options, run->line, run->text, e, name, &self, &usage);
+				}
+				has_ret_code = 1;
+				if (to_child[0] != STDIN_FILENO)
+					close(to_child[0]);
+				free(args[n_processes]);
+				continue;
 			}
-			for (i = 0; i < n_processes; i++) {
-				free(args[i]);
+			if (is_subshell || is_copy || is_forked_builtin(name))
+				args[n_processes][0] = NULL;
+			else
+				args[n_processes][0] = (char *) command_hash_lookup(hash, name);
+
+			n_processes++;
+			ids = (pid_t *) realloc(ids, n_processes*sizeof(pid_t));
+			if (is_measured) {
+				starts = realloc(starts, n_processes * sizeof(*starts));
+				stages = realloc(stages, n_processes * sizeof(*stages));
+				starts[n_processes - 1] = profile_now();
+				stages[n_processes - 1] = e;
 			}
-			if (!(*exit_flag)) {
-				if (e != NULL && e->type == EXPR_TYPE_AND) {
-					if (ret_code == 0)
-						e = e->next;
-					else {
-						while (e != NULL && e->type != EXPR_TYPE_OR)
-							e = e->next;
-						if (e)
-							e = e->next;
+			pid_t id = 0;
+			if (!is_last) {
+				int old_in = to_child[0];
+				pipe2(to_child, O_CLOEXEC);
+				if (options->pipe_size > 0)
+					fcntl(to_child[1], F_SETPIPE_SZ, options->pipe_size);
+				id = fork();
+				if (id == 0) {
+					if (options->pin_cpus)
+						pin_to_cpu(n_processes - 1);
+					if (old_in != STDIN_FILENO) {
+						dup2(old_in, STDIN_FILENO);
+						close(old_in);
+					}
+					dup2(to_child[1], STDOUT_FILENO);
+					close(to_child[0]);
+					close(to_child[1]);
+					redirects_apply(cmd->redirects);
+					if (is_subshell)
+						run_subshell(run, stage->body, ret_code);
+					exec_command(args[n_processes-1][0], &args[n_processes-1][1], hash);
+				}
+				if (old_in != STDIN_FILENO) {
+					close(old_in);
+				}
+				close(to_child[1]);
+			} else {
+				id = fork();
+				if (id == 0) {
+					if (options->pin_cpus)
+						pin_to_cpu(n_processes - 1);
+					if (to_child[0] != STDIN_FILENO) {
+						dup2(to_child[0], STDIN_FILENO);
+						close(to_child[0]);
+					}
+					if (output != STDOUT_FILENO) {
+						dup2(output, STDOUT_FILENO);
+						close(output);
 					}
-				} else if (e != NULL && e->type == EXPR_TYPE_OR) {
-						if (ret_code == 0) {
-							while (e != NULL && e->type != EXPR_TYPE_AND)
-								e = e->next;
-							if (e)
-								e = e->next;
-						} else
-							e = e->next;
+					redirects_apply(cmd->redirects);
+					if (is_subshell)
+						run_subshell(run, stage->body, ret_code);
+					exec_command(args[n_processes-1][0], &args[n_processes-1][1], hash);
+				}
+				if (to_child[0] != STDIN_FILENO) {
+					close(to_child[0]);
 				}
 			}
+			ids[n_processes-1] = id;
+		}
+	}
+	for (i = 0; i < n_processes; i++) {
+		int status = 0;
+		struct rusage ru;
+		pid_t id = job_table_wait_foreground(run->jobs, &status, is_measured ? &ru : NULL);
+		if (!has_ret_code && id == ids[n_processes-1])
+			ret_code = WEXITSTATUS(status);
+		for (int k = 0; is_measured && k < n_processes; ++k) {
+			if (ids[k] != id)
+				continue;
+			struct profile_usage u;
+			profile_usage_create(&u, &ru, profile_now() - starts[k]);
+			account_stage(options, run->line, run->text, stages[k], args[k][1], &u, &usage);
+		}
+	}
+	if (timed != NULL) {
+		usage.real = profile_now() - pipeline_start;
+		print_time(&usage);
+	}
+	for (i = 0; i < n_processes; i++) {
+		free(args[i]);
+	}
+	free(ids);
+	free(args);
+	free(starts);
+	free(stages);
+	return ret_code;
+}
+
+/**
+ * Run the compiled line from the step @a pc until the end of its level.
+ * Short-circuiting is already resolved into the step jumps.
+ */
+static int run_program(struct line_run *run, uint32_t pc, int ret_code)
+{
+	while (!(*run->exit_flag) && pc != PROGRAM_END) {
+		const struct program_step *step = &run->program.steps[pc];
+		ret_code = run_pipeline(run, step, ret_code);
+		pc = step->next[ret_code != 0];
+	}
+	return ret_code;
+}
+
+static int execute_command_line(const struct command_line *line, int * exit_flag, struct job_table *jobs, struct command_hash *hash, struct shell_options *options)
+{
+	assert(line != NULL);
+	pid_t tid = -1;
+
+	job_table_reap(jobs);
+
+	if ((int)line->is_background) {
+		tid = fork();
+		if (tid == 0) {
+			job_table_clear(jobs);
+			shell_options_drop_profile(options);
+		} else {
+			job_table_add(jobs, tid);
 		}
-		free(ids);
-		free(args);
-		if (output != STDOUT_FILENO)
-			close(output);
-		dup2(old_stdout, STDOUT_FILENO);
+	}
 
-		if (tid == 0)
-			*exit_flag = 1;
+	if (tid > 0)
+		return 0;
+
+	struct line_run run;
+	run.line = line;
+	run.exit_flag = exit_flag;
+	run.jobs = jobs;
+	run.hash = hash;
+	run.options = options;
+	run.text = NULL;
+	/*
+	 * The output file is opened once for the whole line. The
+	 * children make it their stdout themselves, builtins write to
+	 * it directly.
+	 */
+	run.output = STDOUT_FILENO;
+	if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
+		run.output = open(line->out_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	} else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
+		run.output = open(line->out_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	}
+	int ret_code = 0;
+	double line_start = 0;
+	if (options->profile != NULL) {
+		run.text = command_line_text(line);
+		line_start = profile_now();
+	}
+	if (run.output < 0) {
+		fprintf(stderr, "%s: %s\n", line->out_file, strerror(errno));
+		ret_code = 1;
+	} else {
+		program_create(&run.program, line);
+		ret_code = run_program(&run, 0, ret_code);
+		program_destroy(&run.program);
+		if (run.output != STDOUT_FILENO)
+			close(run.output);
+	}
+	if (run.text != NULL) {
+		if (options->profile != NULL)
+			profile_add_line(options->profile, run.text, profile_now() - line_start);
+		free(run.text);
+	}
 
-		return ret_code;
-	} else
+	if (tid == 0)
+		*exit_flag = 1;
+
+	return ret_code;
+}
+
+static void execute_parsed(struct parser *p, int * exit_flag, struct job_table *jobs, struct command_hash *hash, struct shell_options *options, int * ret_code)
+{
+	struct command_line *line = NULL;
+	while (!(*exit_flag)) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		if (err != PARSER_ERR_NONE) {
+			printf("Error: %d\n", (int)err);
+			continue;
+		}
+		*ret_code = execute_command_line(line, exit_flag, jobs, hash, options);
+		command_line_delete(line);
+	}
+}
+
+/**
+ * Execute a script file. It is mapped into the memory and parsed in
+ * place, without copying it chunk by chunk into the parser buffer.
+ */
+static int run_script(const char *path, struct parser *p, int * exit_flag, struct job_table *jobs, struct command_hash *hash, struct shell_options *options, int * ret_code)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	if ((uint64_t)st.st_size > UINT32_MAX) {
+		fprintf(stderr, "%s: script is too big\n", path);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
 		return 0;
+	}
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	parser_feed_external(p, data, st.st_size);
+	execute_parsed(p, exit_flag, jobs, hash, options, ret_code);
+	/* The last line might be not terminated. It is copied then. */
+	if (!(*exit_flag)) {
+		parser_feed(p, "\n", 1);
+		execute_parsed(p, exit_flag, jobs, hash, options, ret_code);
+	}
+	munmap(data, st.st_size);
+	return 0;
 }
 
-int main(void)
+/*
+ * Usage:
+ *     a.out [script] - run the script or the commands from stdin.
+ *     a.out --server socket [script] - run scripts sent to the socket,
+ *         each in a child forked from the server. The script runs in
+ *         the server before it starts listening.
+ *     a.out --connect socket script - run the script on the server with
+ *         the current stdin, stdout and stderr.
+ */
+int main(int argc, char **argv)
 {
 	const size_t buf_size = 1024;
 	char buf[buf_size];
-	pid_t * bg_pids = NULL;
-	int bg_num = 0;
 	int rc;
 	int exit_flag = 0;
 	int ret_code = 0;
+	if (argc > 3 && strcmp(argv[1], "--connect") == 0) {
+		rc = server_client_run(argv[2], argv[3]);
+		if (rc < 0) {
+			perror(argv[2]);
+			return 1;
+		}
+		return rc;
+	}
 	struct parser *p = parser_new();
-
-	while (!exit_flag && (rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
-		parser_feed(p, buf, rc);
-		struct command_line *line = NULL;
-		while (!exit_flag) {
-			enum parser_error err = parser_pop_next(p, &line);
-			if (err == PARSER_ERR_NONE && line == NULL)
-				break;
-			if (err != PARSER_ERR_NONE) {
-				printf("Error: %d\n", (int)err);
-				continue;
+	struct command_hash *hash = command_hash_new();
+	struct job_table *jobs = job_table_new();
+	struct shell_options options = {0, false, NULL, NULL};
+	/* The connection of a script run by the server. */
+	int conn = -1;
+	int input = STDIN_FILENO;
+	if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+		/*
+		 * The start script prepares the state each script begins
+		 * with, for example the command hash.
+		 */
+		if (argc > 3 && run_script(argv[3], p, &exit_flag, jobs, hash, &options, &ret_code) != 0) {
+			ret_code = 1;
+			exit_flag = 1;
+		}
+		job_table_wait_all(jobs);
+		if (!exit_flag) {
+			/* Returns only in the children, one per script. */
+			conn = server_run(argv[2]);
+			ret_code = 0;
+			if (conn < 0) {
+				perror(argv[2]);
+				ret_code = 1;
+				exit_flag = 1;
 			}
-			ret_code = execute_command_line(line, &exit_flag, &bg_pids, &bg_num);
-			command_line_delete(line);
+		}
+		input = conn;
+	} else {
+		/* Profiling of the whole run without changing the scripts. */
+		const char *profile_path = getenv("SHELL_PROFILE");
+		if (profile_path != NULL && *profile_path != 0)
+			shell_options_start_profile(&options, profile_path);
+	}
+
+	if (conn < 0 && argc > 1) {
+		if (!exit_flag && run_script(argv[1], p, &exit_flag, jobs, hash, &options, &ret_code) != 0)
+			ret_code = 1;
+	} else {
+		while (!exit_flag && (rc = read(input, buf, buf_size)) > 0) {
+			parser_feed(p, buf, rc);
+			execute_parsed(p, &exit_flag, jobs, hash, &options, &ret_code);
+		}
+		/* The last line might be not terminated, like in a script. */
+		if (!exit_flag) {
+			parser_feed(p, "\n", 1);
+			execute_parsed(p, &exit_flag, jobs, hash, &options, &ret_code);
 		}
 	}
 	parser_delete(p);
+	command_hash_delete(hash);
 
-	wait_bg(bg_pids, &bg_num, 0);
-	free(bg_pids);
+	job_table_wait_all(jobs);
+	job_table_delete(jobs);
+	shell_options_stop_profile(&options);
+	if (conn >= 0)
+		server_reply(conn, ret_code);
 
 	return ret_code;
 }
@@ -0,0 +1,366 @@
+#include "image.h"
+#include "name_hash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+	/** Pieces of data in one write. */
+	IMAGE_WRITE_BATCH = 1024,
+	/**
+	 * Gaps between the files up to this size are written as zeros,
+	 * so the writes don't break on small files. The bigger ones are
+	 * left as holes.
+	 */
+	IMAGE_MAX_ZERO_GAP = 64 * 1024,
+};
+
+static const char image_magic[8] = {'U', 'F', 'S', 'I', 'M', 'A', 'G', 'E'};
+
+static const char image_zeros[IMAGE_MAX_ZERO_GAP];
+
+static uint64_t
+image_align(uint64_t offset, uint64_t align)
+{
+	return (offset + align - 1) & ~(align - 1);
+}
+
+/** Check that @a len bytes from @a offset are in the image. */
+static bool
+image_has_range(const struct image *img, uint64_t offset, uint64_t len)
+{
+	return offset <= img->size && len <= img->size - offset;
+}
+
+static bool
+image_is_valid(struct image *img)
+{
+	if (img->size < sizeof(struct image_super))
+		return false;
+	const struct image_super *super = (const struct image_super *)img->map;
+	if (memcmp(super->magic, image_magic, sizeof(image_magic)) != 0 ||
+	    super->version != IMAGE_VERSION || super->size != img->size)
+		return false;
+	uint32_t count = super->file_count;
+	uint32_t capacity = super->index_capacity;
+	if (capacity <= count || (capacity & (capacity - 1)) != 0)
+		return false;
+	if (super->inodes_offset % alignof(struct image_inode) != 0 ||
+	    !image_has_range(img, super->inodes_offset,
+			     (uint64_t)count * sizeof(struct image_inode)))
+		return false;
+	if (super->index_offset % sizeof(uint32_t) != 0 ||
+	    !image_has_range(img, super->index_offset,
+			     (uint64_t)capacity * sizeof(uint32_t)))
+		return false;
+	if (super->names_size == 0 ||
+	    !image_has_range(img, super->names_offset, super->names_size))
+		return false;
+	img->super = super;
+	img->inodes = (const struct image_inode *)(img->map +
+						   super->inodes_offset);
+	img->index = (const uint32_t *)(img->map + super->index_offset);
+	img->names = img->map + super->names_offset;
+	if (img->names[super->names_size - 1] != 0)
+		return false;
+	/* The data of the files follow each other and nothing else. */
+	uint64_t data_end = super->names_offset + super->names_size;
+	for (uint32_t i = 0; i < count; ++i) {
+		const struct image_inode *inode = &img->inodes[i];
+		if (inode->name_offset >= super->names_size ||
+		    inode->size > inode->data_reserve ||
+		    inode->data_offset < data_end ||
+		    inode->data_offset % IMAGE_DATA_ALIGN != 0 ||
+		    !image_has_range(img, inode->data_offset,
+				     inode->data_reserve))
+			return false;
+		data_end = inode->data_offset + inode->data_reserve;
+		const char *name = image_inode_name(img, inode);
+		if (inode->name_hash != name_hash_str(name))
+			return false;
+	}
+	/*
+	 * As many used slots as the inodes and each inode found from its
+	 * hash mean each of them is in the index once. The capacity is
+	 * bigger than the count, so there are free slots to end a search.
+	 */
+	uint32_t used = 0;
+	for (uint32_t i = 0; i < capacity; ++i) {
+		if (img->index[i] > count)
+			return false;
+		used += img->index[i] != 0;
+	}
+	if (used != count)
+		return false;
+	uint32_t mask = capacity - 1;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t j = img->inodes[i].name_hash & mask;
+		while (img->index[j] != i + 1) {
+			if (img->index[j] == 0)
+				return false;
+			j = (j + 1) & mask;
+		}
+	}
+	return true;
+}
+
+int
+image_map(struct image *img, const char *path)
+{
+	memset(img, 0, sizeof(*img));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	img->map = map;
+	img->size = st.st_size;
+	if (!image_is_valid(img)) {
+		image_unmap(img);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+image_unmap(struct image *img)
+{
+	if (img->map != NULL)
+		munmap(img->map, img->size);
+	memset(img, 0, sizeof(*img));
+}
+
+int
+image_find(const struct image *img, const char *name)
+{
+	if (img->map == NULL)
+		return -1;
+	uint32_t hash = name_hash_str(name);
+	uint32_t mask = img->super->index_capacity - 1;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+		uint32_t slot = img->index[i];
+		if (slot == 0)
+			return -1;
+		const struct image_inode *inode = &img->inodes[slot - 1];
+		if (inode->name_hash == hash &&
+		    strcmp(image_inode_name(img, inode), name) == 0)
+			return slot - 1;
+	}
+}
+
+/** Write all the pieces, the array is changed on partial writes. */
+static int
+image_pwritev(int fd, struct iovec *iov, int count, uint64_t offset)
+{
+	while (count > 0) {
+		ssize_t rc = pwritev(fd, iov, count, offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		offset += rc;
+		while (count > 0 && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+/** Pieces of data going to one place of the image. */
+struct image_batch {
+	struct iovec iov[IMAGE_WRITE_BATCH];
+	int count;
+	/** Where the batch goes, and where it ends. */
+	uint64_t offset;
+	uint64_t end;
+};
+
+static int
+image_batch_flush(struct image_batch *b, int fd)
+{
+	int rc = image_pwritev(fd, b->iov, b->count, b->offset);
+	b->count = 0;
+	b->offset = b->end;
+	return rc;
+}
+
+static int
+image_batch_add(struct image_batch *b, int fd, const void *data, size_t size)
+{
+	if (size == 0)
+		return 0;
+	if (b->count == IMAGE_WRITE_BATCH && image_batch_flush(b, fd) != 0)
+		return -1;
+	b->iov[b->count].iov_base = (void *)data;
+	b->iov[b->count].iov_len = size;
+	b->count++;
+	b->end += size;
+	return 0;
+}
+
+/** Continue the batch from @a offset, with zeros or a hole before it. */
+static int
+image_batch_seek(struct image_batch *b, int fd, uint64_t offset)
+{
+	uint64_t gap = offset - b->end;
+	if (gap <= IMAGE_MAX_ZERO_GAP)
+		return image_batch_add(b, fd, image_zeros, gap);
+	if (image_batch_flush(b, fd) != 0)
+		return -1;
+	b->offset = offset;
+	b->end = offset;
+	return 0;
+}
+
+int
+image_write(struct image_writer *w, const char *path,
+	    const struct image_file *files, uint32_t count)
+{
+	uint32_t capacity = 2;
+	while (capacity <= (uint64_t)count * 2)
+		capacity *= 2;
+	uint64_t inodes_offset = sizeof(struct image_super);
+	uint64_t index_offset = inodes_offset +
+				(uint64_t)count * sizeof(struct image_inode);
+	uint64_t names_offset = index_offset +
+				(uint64_t)capacity * sizeof(uint32_t);
+	uint64_t names_size = 0;
+	for (uint32_t i = 0; i < count; ++i)
+		names_size += strlen(files[i].name) + 1;
+	/* The names end with 0 even if there are no files. */
+	if (names_size == 0)
+		names_size = 1;
+	uint64_t data_offset = image_align(names_offset + names_size,
+					   IMAGE_DATA_ALIGN);
+
+	/* All but the data is built in memory and written at once. */
+	char *head = calloc(1, names_offset + names_size);
+	struct image_batch *batch = malloc(sizeof(*batch));
+	char *tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+	if (head == NULL || batch == NULL || tmp_path == NULL) {
+		free(head);
+		free(batch);
+		free(tmp_path);
+		errno = ENOMEM;
+		return -1;
+	}
+	struct image_super *super = (struct image_super *)head;
+	struct image_inode *inodes = (struct image_inode *)(head +
+							   inodes_offset);
+	uint32_t *index = (uint32_t *)(head + index_offset);
+	char *names = head + names_offset;
+	uint64_t name_offset = 0;
+	uint64_t offset = data_offset;
+	for (uint32_t i = 0; i < count; ++i) {
+		struct image_inode *inode = &inodes[i];
+		size_t len = strlen(files[i].name) + 1;
+		memcpy(names + name_offset, files[i].name, len);
+		inode->name_offset = name_offset;
+		inode->name_hash = name_hash_str(files[i].name);
+		name_offset += len;
+		inode->size = files[i].size;
+		inode->data_offset = offset;
+		inode->data_reserve = files[i].reserve;
+		offset = image_align(offset + files[i].reserve,
+				     IMAGE_DATA_ALIGN);
+		uint32_t j = inode->name_hash & (capacity - 1);
+		while (index[j] != 0)
+			j = (j + 1) & (capacity - 1);
+		index[j] = i + 1;
+	}
+	memcpy(super->magic, image_magic, sizeof(image_magic));
+	super->version = IMAGE_VERSION;
+	super->file_count = count;
+	super->index_capacity = capacity;
+	super->inodes_offset = inodes_offset;
+	super->index_offset = index_offset;
+	super->names_offset = names_offset;
+	super->names_size = names_size;
+	super->size = offset;
+
+	strcpy(tmp_path, path);
+	strcat(tmp_path, ".tmp");
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int rc = fd < 0 ? -1 : 0;
+	batch->count = 0;
+	batch->offset = 0;
+	batch->end = 0;
+	if (rc == 0)
+		rc = image_batch_add(batch, fd, head, names_offset + names_size);
+	for (uint32_t i = 0; i < count && rc == 0; ++i) {
+		rc = image_batch_seek(batch, fd, inodes[i].data_offset);
+		for (int j = 0; j < files[i].data_count && rc == 0; ++j) {
+			rc = image_batch_add(batch, fd, files[i].data[j].iov_base,
+					     files[i].data[j].iov_len);
+		}
+	}
+	if (rc == 0)
+		rc = image_batch_flush(batch, fd);
+	/* The room after the last data is a hole. */
+	if (rc == 0)
+		rc = ftruncate(fd, super->size);
+	int saved_errno = errno;
+	free(head);
+	free(batch);
+	if (rc != 0) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		free(tmp_path);
+		errno = saved_errno;
+		return -1;
+	}
+	w->fd = fd;
+	w->path = path;
+	w->tmp_path = tmp_path;
+	return 0;
+}
+
+int
+image_commit(struct image_writer *w)
+{
+	int rc = fsync(w->fd);
+	int saved_errno = errno;
+	if (close(w->fd) != 0 && rc == 0) {
+		rc = -1;
+		saved_errno = errno;
+	}
+	if (rc == 0 && rename(w->tmp_path, w->path) != 0) {
+		rc = -1;
+		saved_errno = errno;
+	}
+	if (rc != 0)
+		unlink(w->tmp_path);
+	free(w->tmp_path);
+	errno = saved_errno;
+	return rc;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * On-disk image of userfs files. An image is mapped to memory and used
+ * in place, without parsing, so its parts are aligned and in the byte
+ * order of the host. It consists of:
+ * - the superblock;
+ * - the inode table, an inode per file;
+ * - the name index, a hash table from a name to its inode with linear
+ *   probing, like in name_hash;
+ * - the names, each ended with 0;
+ * - the file data. The data of a file is one run of bytes, followed by
+ *   a room for it to grow. The room is given by the writer, so the
+ *   file memory can be cut into extents right in the mapping.
+ */
+
+enum {
+	IMAGE_VERSION = 1,
+	/** Alignment of the data of each file. */
+	IMAGE_DATA_ALIGN = 64,
+};
+
+struct image_super {
+	/** "UFSIMAGE". */
+	char magic[8];
+	uint32_t version;
+	uint32_t file_count;
+	/** Slots in the name index, a power of 2. */
+	uint32_t index_capacity;
+	uint32_t unused;
+	uint64_t inodes_offset;
+	uint64_t index_offset;
+	uint64_t names_offset;
+	uint64_t names_size;
+	/** Size of the whole image. */
+	uint64_t size;
+};
+
+struct image_inode {
+	/** Data size. */
+	uint64_t size;
+	uint64_t data_offset;
+	/** Data size with the room to grow. */
+	uint64_t data_reserve;
+	/** Offset in the names. */
+	uint64_t name_offset;
+	/** name_hash_str() of the name. */
+	uint32_t name_hash;
+	uint32_t unused;
+};
+
+/** A mapped image. */
+struct image {
+	/**
+	 * The mapping, NULL if there is no image. It is private and
+	 * writable: the writes copy the touched pages and never reach
+	 * the disk.
+	 */
+	char *map;
+	size_t size;
+	const struct image_super *super;
+	const struct image_inode *inodes;
+	/** Inode number + 1 per slot, 0 for a free slot. */
+	const uint32_t *index;
+	const char *names;
+};
+
+/**
+ * Map and check the image at @a path.
+ * @retval 0 Success.
+ * @retval -1 The file can't be read or is not a valid image.
+ */
+int
+image_map(struct image *img, const char *path);
+
+void
+image_unmap(struct image *img);
+
+/** Number of the inode with @a name or -1. */
+int
+image_find(const struct image *img, const char *name);
+
+static inline const char *
+image_inode_name(const struct image *img, const struct image_inode *inode)
+{
+	return img->names + inode->name_offset;
+}
+
+static inline char *
+image_inode_data(const struct image *img, const struct image_inode *inode)
+{
+	return img->map + inode->data_offset;
+}
+
+/** Check if @a ptr is the memory of the image. */
+static inline bool
+image_contains(const struct image *img, const void *ptr)
+{
+	return img->map != NULL && (const char *)ptr >= img->map &&
+	       (const char *)ptr < img->map + img->size;
+}
+
+/** A file for image_write(). */
+struct image_file {
+	const char *name;
+	/** Data size. */
+	size_t size;
+	/** Data size with the room to grow, not less than the size. */
+	size_t reserve;
+	/** The data in pieces. */
+	const struct iovec *data;
+	int data_count;
+};
+
+/** An image written to a temporary file, see image_write(). */
+struct image_writer {
+	int fd;
+	const char *path;
+	char *tmp_path;
+};
+
+/**
+ * Write the files to an image for @a path. The image is written to a
+ * temporary file, and image_commit() puts it in place, so the old
+ * image, including a mapped one, stays valid until the new one is
+ * complete. The data goes to the disk right from the given pieces,
+ * many of them per write. They are not used after the return, and the
+ * slow part, the sync, is left to image_commit().
+ *
+ * @retval 0 Success, image_commit() is to be called.
+ * @retval -1 An I/O error, errno is set. Nothing is left to commit.
+ */
+int
+image_write(struct image_writer *w, const char *path,
+	    const struct image_file *files, uint32_t count);
+
+/**
+ * Sync the image written by image_write() and rename it to its path.
+ * @a path given to image_write() has to be valid until now.
+ *
+ * @retval 0 Success.
+ * @retval -1 An I/O error, errno is set. The image is deleted.
+ */
+int
+image_commit(struct image_writer *w);
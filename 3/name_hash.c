@@ -0,0 +1,174 @@
+#include "name_hash.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/** Old table slots moved by each insertion and removal. */
+	NAME_HASH_MOVE_STEP = 8,
+};
+
+/**
+ * Marks a slot of the old table which is already moved or removed.
+ * The slot can't be freed, because probe chains can pass through it.
+ */
+static const char name_hash_moved[] = "";
+
+uint32_t
+name_hash_str(const char *str)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *str != 0; ++str) {
+		h ^= (unsigned char)*str;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void
+name_hash_create(struct name_hash *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void
+name_hash_destroy(struct name_hash *h)
+{
+	free(h->table.entries);
+	free(h->old.entries);
+}
+
+/** Slot with the name or the free slot where it would be. */
+static struct name_hash_entry *
+name_hash_table_find_slot(const struct name_hash_table *t, const char *name,
+			  uint32_t hash)
+{
+	uint32_t mask = t->capacity - 1;
+	uint32_t i = hash & mask;
+	while (true) {
+		struct name_hash_entry *e = &t->entries[i];
+		if (e->name == NULL)
+			return e;
+		if (e->hash == hash && e->name != name_hash_moved &&
+		    strcmp(e->name, name) == 0)
+			return e;
+		i = (i + 1) & mask;
+	}
+}
+
+static struct name_hash_entry *
+name_hash_table_find(const struct name_hash_table *t, const char *name,
+		     uint32_t hash)
+{
+	if (t->count == 0)
+		return NULL;
+	struct name_hash_entry *e = name_hash_table_find_slot(t, name, hash);
+	return e->name != NULL ? e : NULL;
+}
+
+/**
+ * Delete an entry of the new table keeping the probe chains valid.
+ * The following entries of the same cluster are shifted back to fill
+ * the hole.
+ */
+static void
+name_hash_table_remove(struct name_hash_table *t, struct name_hash_entry *e)
+{
+	uint32_t mask = t->capacity - 1;
+	uint32_t hole = e - t->entries;
+	e->name = NULL;
+	--t->count;
+	for (uint32_t i = (hole + 1) & mask; t->entries[i].name != NULL;
+	     i = (i + 1) & mask) {
+		uint32_t home = t->entries[i].hash & mask;
+		/* Can move only if the hole is between home and i. */
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+		t->entries[hole] = t->entries[i];
+		t->entries[i].name = NULL;
+		hole = i;
+	}
+}
+
+/** Move up to @a count slots of the old table into the new one. */
+static void
+name_hash_move(struct name_hash *h, uint32_t count)
+{
+	if (h->old.entries == NULL)
+		return;
+	for (; count > 0 && h->old.count > 0; --count) {
+		struct name_hash_entry *e = &h->old.entries[h->move_pos++];
+		if (e->name == NULL || e->name == name_hash_moved)
+			continue;
+		*name_hash_table_find_slot(&h->table, e->name, e->hash) = *e;
+		++h->table.count;
+		e->name = name_hash_moved;
+		--h->old.count;
+	}
+	if (h->old.count == 0) {
+		free(h->old.entries);
+		memset(&h->old, 0, sizeof(h->old));
+		h->move_pos = 0;
+	}
+}
+
+void *
+name_hash_find(const struct name_hash *h, const char *name)
+{
+	uint32_t hash = name_hash_str(name);
+	struct name_hash_entry *e = name_hash_table_find(&h->table, name, hash);
+	if (e == NULL)
+		e = name_hash_table_find(&h->old, name, hash);
+	return e != NULL ? e->value : NULL;
+}
+
+void
+name_hash_insert(struct name_hash *h, const char *name, void *value)
+{
+	assert(name_hash_find(h, name) == NULL);
+	name_hash_move(h, NAME_HASH_MOVE_STEP);
+	if ((h->table.count + 1) * 4 > h->table.capacity * 3) {
+		/*
+		 * The previous move is normally done long before, but finish
+		 * it anyway to have only two tables.
+		 */
+		name_hash_move(h, UINT32_MAX);
+		h->old = h->table;
+		h->move_pos = 0;
+		uint32_t capacity = h->old.capacity == 0 ? 16 :
+				    h->old.capacity * 2;
+		h->table.entries = calloc(capacity, sizeof(*h->table.entries));
+		h->table.capacity = capacity;
+		h->table.count = 0;
+		/* An empty old table is freed right away. */
+		name_hash_move(h, 0);
+	}
+	uint32_t hash = name_hash_str(name);
+	struct name_hash_entry *e =
+		name_hash_table_find_slot(&h->table, name, hash);
+	e->name = name;
+	e->hash = hash;
+	e->value = value;
+	++h->table.count;
+}
+
+void *
+name_hash_remove(struct name_hash *h, const char *name)
+{
+	uint32_t hash = name_hash_str(name);
+	void *value = NULL;
+	struct name_hash_entry *e = name_hash_table_find(&h->table, name, hash);
+	if (e != NULL) {
+		value = e->value;
+		name_hash_table_remove(&h->table, e);
+	} else if ((e = name_hash_table_find(&h->old, name, hash)) != NULL) {
+		value = e->value;
+		e->name = name_hash_moved;
+		--h->old.count;
+	}
+	name_hash_move(h, NAME_HASH_MOVE_STEP);
+	return value;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Hash table from a name to a pointer. Open addressing with linear
+ * probing. The table grows incrementally: when it is full enough, a
+ * twice bigger one is allocated, and each following insertion or
+ * removal moves a few entries from the old table. So no operation
+ * rehashes the whole table at once. Lookups check both tables while
+ * the move is in progress.
+ *
+ * The names are not copied, they must stay valid while in the table.
+ */
+
+struct name_hash_entry {
+	/** NULL for a free slot. */
+	const char *name;
+	uint32_t hash;
+	void *value;
+};
+
+struct name_hash_table {
+	struct name_hash_entry *entries;
+	/** Always a power of 2 or 0. */
+	uint32_t capacity;
+	uint32_t count;
+};
+
+struct name_hash {
+	/** The table to insert into. */
+	struct name_hash_table table;
+	/** The table being moved into the new one, if any. */
+	struct name_hash_table old;
+	/** Slots of the old table before this one are moved already. */
+	uint32_t move_pos;
+};
+
+/**
+ * Hash of a name. It does not depend on the process, so it can be
+ * stored, like in the userfs images.
+ */
+uint32_t
+name_hash_str(const char *str);
+
+void
+name_hash_create(struct name_hash *h);
+
+void
+name_hash_destroy(struct name_hash *h);
+
+/** Value stored by @a name or NULL. */
+void *
+name_hash_find(const struct name_hash *h, const char *name);
+
+/** Add a name which is not in the table yet. */
+void
+name_hash_insert(struct name_hash *h, const char *name, void *value);
+
+/**
+ * Remove a name.
+ * @retval not NULL Value stored by the name.
+ * @retval NULL The name is not found.
+ */
+void *
+name_hash_remove(struct name_hash *h, const char *name);
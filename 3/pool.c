@@ -0,0 +1,110 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/** Slab size to aim at. Bigger objects take a slab each. */
+	POOL_SLAB_SIZE = 64 * 1024,
+};
+
+/** Slab header, the objects follow it. */
+struct pool_slab {
+	struct pool_slab *next;
+	struct pool_slab *prev;
+	alignas(max_align_t) char objects[];
+};
+
+void
+pool_create(struct pool *p, size_t object_size)
+{
+	memset(p, 0, sizeof(*p));
+	p->object_size = object_size;
+}
+
+void
+pool_destroy(struct pool *p)
+{
+	struct pool_slab *slab = p->slabs;
+	while (slab != NULL) {
+		struct pool_slab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+	pool_create(p, p->object_size);
+}
+
+/** Object size, rounded up to keep all the objects aligned. */
+static size_t
+pool_step(const struct pool *p)
+{
+	size_t align = alignof(max_align_t);
+	size_t size = p->object_size < sizeof(void *) ? sizeof(void *) :
+		      p->object_size;
+	return (size + align - 1) & ~(align - 1);
+}
+
+/** Objects which don't fit 2 in a slab take a slab each. */
+static bool
+pool_is_big(const struct pool *p)
+{
+	return POOL_SLAB_SIZE / pool_step(p) < 2;
+}
+
+static struct pool_slab *
+pool_slab_new(struct pool *p, size_t size)
+{
+	struct pool_slab *slab = malloc(sizeof(*slab) + size);
+	slab->next = p->slabs;
+	slab->prev = NULL;
+	if (p->slabs != NULL)
+		p->slabs->prev = slab;
+	p->slabs = slab;
+	return slab;
+}
+
+void *
+pool_alloc(struct pool *p)
+{
+	assert(p->object_size > 0);
+	if (pool_is_big(p))
+		return pool_slab_new(p, pool_step(p))->objects;
+	if (p->free_list != NULL) {
+		void *ptr = p->free_list;
+		p->free_list = *(void **)ptr;
+		return ptr;
+	}
+	size_t step = pool_step(p);
+	if (p->slab_pos == p->slab_end) {
+		size_t count = POOL_SLAB_SIZE / step;
+		struct pool_slab *slab = pool_slab_new(p, count * step);
+		p->slab_pos = slab->objects;
+		p->slab_end = slab->objects + count * step;
+	}
+	void *ptr = p->slab_pos;
+	p->slab_pos += step;
+	return ptr;
+}
+
+void
+pool_free(struct pool *p, void *ptr)
+{
+	if (pool_is_big(p)) {
+		struct pool_slab *slab = (struct pool_slab *)
+			((char *)ptr - offsetof(struct pool_slab, objects));
+		if (slab->prev != NULL)
+			slab->prev->next = slab->next;
+		else
+			p->slabs = slab->next;
+		if (slab->next != NULL)
+			slab->next->prev = slab->prev;
+		free(slab);
+		return;
+	}
+	*(void **)ptr = p->free_list;
+	p->free_list = ptr;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Allocator of objects of one size. The objects are cut from slabs
+ * holding many of them, the freed ones are kept in a list for reuse.
+ * So most allocations and frees are a couple of pointer moves, and the
+ * objects of one kind lie densely. Their memory is returned to the
+ * system only all at once, by pool_destroy().
+ *
+ * An object bigger than half a slab takes a slab of its own, and it is
+ * returned to the system as soon as it is freed. There is nothing to
+ * save on such allocations, while keeping them would hold all the
+ * memory a pool has ever had.
+ */
+
+struct pool_slab;
+
+struct pool {
+	/** Size of an object. 0 means the pool is not created. */
+	size_t object_size;
+	/** Freed objects, linked through their first bytes. */
+	void *free_list;
+	/** Never used objects of the newest slab. */
+	char *slab_pos;
+	char *slab_end;
+	/** All the slabs, with the big objects in use. */
+	struct pool_slab *slabs;
+};
+
+/**
+ * The pool needs no memory until the first allocation, so a static one
+ * can be initialized with just its object size.
+ */
+void
+pool_create(struct pool *p, size_t object_size);
+
+/** Free all the slabs, with all the objects, allocated or not. */
+void
+pool_destroy(struct pool *p);
+
+void *
+pool_alloc(struct pool *p);
+
+void
+pool_free(struct pool *p, void *ptr);
@@ -1,8 +1,15 @@
 #include "userfs.h"
+#include "image.h"
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -93,6 +100,153 @@ test_close(void)
 	unit_test_finish();
 }
 
+static void
+test_descriptor_reuse(void)
+{
+	unit_test_start();
+
+	int fd1 = ufs_open("file", UFS_CREATE);
+	int fd2 = ufs_open("file", 0);
+	int fd3 = ufs_open("file", 0);
+	unit_fail_if(fd1 == -1 || fd2 == -1 || fd3 == -1);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_check(ufs_open("file", 0) == fd1, "the lowest closed one is reused");
+	unit_check(ufs_open("file", 0) == fd2, "then the next one");
+	int fd4 = ufs_open("file", 0);
+	unit_check(fd4 != fd1 && fd4 != fd2 && fd4 != fd3, "then a new one");
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_close(fd4) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+enum {
+	TEST_THREAD_COUNT = 4,
+	TEST_THREAD_OPS = 1000,
+};
+
+static void *
+test_thread_f(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[16];
+	char buf[64];
+	char data[64];
+	sprintf(name, "file%d", id);
+	memset(data, 'a' + id, sizeof(data));
+	intptr_t failed = 0;
+	int shared = ufs_open("shared", 0);
+	for (int i = 0; i < TEST_THREAD_OPS; ++i) {
+		/* Own file, its name is created and deleted concurrently. */
+		int fd = ufs_open(name, UFS_CREATE);
+		failed |= ufs_write(fd, data, sizeof(data)) != sizeof(data);
+		failed |= ufs_close(fd) != 0;
+		fd = ufs_open(name, 0);
+		failed |= ufs_read(fd, buf, sizeof(buf)) != sizeof(buf);
+		failed |= memcmp(buf, data, sizeof(buf)) != 0;
+		failed |= ufs_delete(name) != 0;
+		failed |= ufs_close(fd) != 0;
+		/* The threads overwrite each other, but by whole blocks. */
+		failed |= ufs_write(shared, data, sizeof(data)) != sizeof(data);
+		/* The error is of this thread only. */
+		failed |= ufs_open("missing", 0) != -1;
+		failed |= ufs_errno() != UFS_ERR_NO_FILE;
+	}
+	failed |= ufs_close(shared) != 0;
+	return (void *)failed;
+}
+
+/** Read a file being shrunk and grown back, from its start again and again. */
+static void *
+test_thread_reader_f(void *arg)
+{
+	(void)arg;
+	char buf[100];
+	intptr_t failed = 0;
+	int fd = ufs_open("resized", 0);
+	for (int i = 0; i < TEST_THREAD_OPS * 10; ++i) {
+		ssize_t rc = ufs_read(fd, buf, sizeof(buf));
+		failed |= rc < 0 || rc > (ssize_t)sizeof(buf);
+		/* Grown by a resize the file has zeros. */
+		for (ssize_t j = 0; j < rc; ++j)
+			failed |= buf[j] != 'x' && buf[j] != 0;
+		if (rc == 0) {
+			failed |= ufs_close(fd) != 0;
+			fd = ufs_open("resized", 0);
+		}
+	}
+	failed |= ufs_close(fd) != 0;
+	return (void *)failed;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	pthread_t threads[TEST_THREAD_COUNT];
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL, test_thread_f,
+					    (void *)(intptr_t)i) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		void *failed;
+		pthread_join(threads[i], &failed);
+		ok = ok && failed == NULL;
+	}
+	unit_check(ok, "concurrent I/O on own and shared files");
+
+	char buf[64];
+	int count = 0;
+	ok = true;
+	ssize_t rc;
+	while (ok && (rc = ufs_read(fd, buf, sizeof(buf))) > 0) {
+		int id = buf[0] - 'a';
+		ok = rc == sizeof(buf) && id >= 0 && id < TEST_THREAD_COUNT;
+		for (size_t i = 0; ok && i < sizeof(buf); ++i)
+			ok = buf[i] == buf[0];
+		++count;
+	}
+	unit_check(ok && count == TEST_THREAD_OPS, "shared file writes are not torn");
+	unit_check(ufs_open("file0", 0) == -1, "own files are deleted");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	/* A resize moves the positions of the readers concurrently. */
+	static char data[64 * 1024];
+	memset(data, 'x', sizeof(data));
+	fd = ufs_open("resized", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_thread_reader_f, NULL) != 0);
+	}
+	ok = true;
+	for (int i = 0; i < TEST_THREAD_OPS; ++i) {
+		ok = ok && ufs_resize(fd, i * 997 % sizeof(data)) == 0;
+		ok = ok && ufs_resize(fd, sizeof(data) - i) == 0;
+	}
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		void *failed;
+		pthread_join(threads[i], &failed);
+		ok = ok && failed == NULL;
+	}
+	unit_check(ok, "reads of a file being resized");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("resized") != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_io(void)
 {
@@ -213,6 +367,110 @@ test_io(void)
 	unit_test_finish();
 }
 
+static void
+test_pread_pwrite(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "world", 5, 6) == 5, "pwrite beyond the end");
+	unit_check(ufs_pwrite(fd, "hello", 5, 0) == 5, "pwrite to the gap");
+	char buf[16];
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 11, "the position is not moved");
+	unit_check(memcmp(buf, "hello\0world", 11) == 0, "the gap is zeros");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 6) == 5, "pread");
+	unit_check(memcmp(buf, "world", 5) == 0, "pread data");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 100) == 0, "pread beyond the end");
+	unit_check(ufs_pwrite(fd, "x", 1, 1024 * 1024 * 1024) == -1, "pwrite too far");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "no mem error");
+	unit_check(ufs_pwrite(fd, "x", 0, 1000) == 0, "empty pwrite beyond the end");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 11) == 0, "the file is not grown");
+
+	char a[3], b[4], c[10];
+	struct iovec iov[] = {{a, sizeof(a)}, {b, sizeof(b)}, {c, sizeof(c)}};
+	int fd2 = ufs_open("file", 0);
+	unit_check(ufs_readv(fd2, iov, 3) == 11, "readv");
+	unit_check(memcmp(a, "hel", 3) == 0 && memcmp(b, "lo\0w", 4) == 0 &&
+		   memcmp(c, "orld", 4) == 0, "readv fills the buffers in turn");
+	struct iovec out[] = {{(void *) "abc", 3}, {(void *) "", 0}, {(void *) "de", 2}};
+	unit_check(ufs_writev(fd2, out, 3) == 5, "writev");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 8) == 8, "pread after writev");
+	unit_check(memcmp(buf, "rldabcde", 8) == 0, "writev appends at the position");
+
+	unit_fail_if(ufs_close(fd2) != 0);
+#ifdef NEED_OPEN_FLAGS
+	fd2 = ufs_open("file", UFS_READ_ONLY);
+	unit_check(ufs_pwrite(fd2, "x", 1, 0) == -1, "no pwrite to a read only file");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "no permission error");
+	unit_fail_if(ufs_close(fd2) != 0);
+#endif
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_pread_view(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 64 * 1024 };
+	char *data = malloc(SIZE);
+	for (int i = 0; i < SIZE; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, SIZE) != SIZE);
+
+	struct iovec iov[16];
+	int count = 16;
+	struct ufs_pin *pin;
+	unit_check(ufs_pread_view(fd, 100, SIZE, iov, &count, &pin) == SIZE - 100,
+		   "view up to the end");
+	bool ok = count > 1;
+	size_t pos = 100;
+	for (int i = 0; ok && i < count; ++i) {
+		ok = memcmp(iov[i].iov_base, data + pos, iov[i].iov_len) == 0;
+		pos += iov[i].iov_len;
+	}
+	unit_check(ok && pos == SIZE, "the spans are the content in order");
+
+	int short_count = 1;
+	struct ufs_pin *short_pin;
+	struct iovec short_iov;
+	ssize_t rc = ufs_pread_view(fd, 0, SIZE, &short_iov, &short_count, &short_pin);
+	unit_check(rc > 0 && rc < SIZE && short_count == 1, "a short view");
+	ufs_unpin(short_pin);
+
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	char *other = malloc(SIZE);
+	memset(other, 'z', SIZE);
+	unit_fail_if(ufs_write(fd, other, SIZE) != SIZE);
+	free(other);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	ok = true;
+	pos = 100;
+	for (int i = 0; ok && i < count; ++i) {
+		ok = memcmp(iov[i].iov_base, data + pos, iov[i].iov_len) == 0;
+		pos += iov[i].iov_len;
+	}
+	unit_check(ok, "the spans survive resize and delete");
+	ufs_unpin(pin);
+
+	fd = ufs_open("file", UFS_CREATE);
+	count = 16;
+	unit_check(ufs_pread_view(fd, 10, 1, iov, &count, &pin) == 0 && count == 0,
+		   "view beyond the end");
+	ufs_unpin(pin);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(data);
+
+	unit_test_finish();
+}
+
 static void
 test_delete(void)
 {
@@ -441,6 +699,123 @@ test_resize(void)
 #endif
 }
 
+static void
+test_image_write(const char *path, const char *image, size_t size)
+{
+	FILE *file = fopen(path, "w");
+	unit_fail_if(file == NULL);
+	unit_fail_if(fwrite(image, 1, size, file) != size);
+	unit_fail_if(fclose(file) != 0);
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "test_image.ufs";
+	enum { SIZE = 100 * 1024 };
+	char *data = malloc(SIZE);
+	char *buf = malloc(SIZE);
+	for (int i = 0; i < SIZE; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, SIZE) != SIZE);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "small", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("empty", UFS_CREATE);
+	unit_fail_if(ufs_close(fd) != 0);
+	int deleted = ufs_open("deleted", UFS_CREATE);
+	unit_fail_if(ufs_delete("deleted") != 0);
+
+	unit_check(ufs_snapshot(path) == 0, "snapshot");
+	unit_check(ufs_mount(path) == -1, "no mount to a not empty FS");
+	unit_check(ufs_errno() == UFS_ERR_IMAGE, "image error");
+	unit_fail_if(ufs_close(deleted) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("empty") != 0);
+	unit_check(ufs_mount("test.c") == -1, "no mount of not an image");
+	unit_check(ufs_mount(path) == 0, "mount");
+
+	fd = ufs_open("big", 0);
+	unit_check(ufs_read(fd, buf, SIZE) == SIZE && memcmp(buf, data, SIZE) == 0,
+		   "the mounted file content");
+	unit_check(ufs_write(fd, "end", 3) == 3, "write to the mounted file");
+	unit_check(ufs_pwrite(fd, "begin", 5, 0) == 5, "rewrite the mounted file");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", 0);
+	unit_check(ufs_read(fd, buf, SIZE) == 5 && memcmp(buf, "small", 5) == 0,
+		   "the small file");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("deleted", 0) == -1, "the deleted file is not saved");
+	unit_check(ufs_delete("empty") == 0, "delete a not opened file");
+	unit_check(ufs_open("empty", 0) == -1, "it is deleted");
+	fd = ufs_open("new", UFS_CREATE);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_check(ufs_snapshot(path) == 0, "snapshot over the mounted image");
+	ufs_destroy();
+	unit_check(ufs_mount(path) == 0, "mount again");
+	fd = ufs_open("big", 0);
+	unit_check(ufs_read(fd, buf, SIZE) == SIZE && memcmp(buf, "begin", 5) == 0 &&
+		   memcmp(buf + 5, data + 5, SIZE - 5) == 0, "the changes are saved");
+	unit_check(ufs_read(fd, buf, SIZE) == 3 && memcmp(buf, "end", 3) == 0,
+		   "the growth is saved");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("empty", 0) == -1, "the deletion is saved");
+	unit_check(ufs_delete("new") == 0 && ufs_delete("big") == 0 &&
+		   ufs_delete("small") == 0, "the files are there");
+	ufs_destroy();
+
+	FILE *file = fopen(path, "r");
+	unit_fail_if(file == NULL);
+	fseek(file, 0, SEEK_END);
+	long image_size = ftell(file);
+	rewind(file);
+	char *image = malloc(image_size);
+	unit_fail_if(fread(image, 1, image_size, file) != (size_t)image_size);
+	fclose(file);
+	struct image_super *super = (struct image_super *)image;
+	struct image_inode *inodes = (struct image_inode *)(image + super->inodes_offset);
+	uint32_t *index = (uint32_t *)(image + super->index_offset);
+	/* A search of a missing name would never end in a full index. */
+	uint32_t free_slot = 0;
+	while (index[free_slot] != 0)
+		++free_slot;
+	uint32_t *saved = malloc(super->index_capacity * sizeof(*index));
+	memcpy(saved, index, super->index_capacity * sizeof(*index));
+	for (uint32_t i = 0; i < super->index_capacity; ++i) {
+		if (index[i] == 0)
+			index[i] = 1;
+	}
+	test_image_write(path, image, image_size);
+	unit_check(ufs_mount(path) == -1, "no mount with a full index");
+	memcpy(index, saved, super->index_capacity * sizeof(*index));
+	index[free_slot] = 1;
+	test_image_write(path, image, image_size);
+	unit_check(ufs_mount(path) == -1, "no mount with an inode twice in the index");
+	index[free_slot] = 0;
+	inodes[0].name_hash ^= 1;
+	test_image_write(path, image, image_size);
+	unit_check(ufs_mount(path) == -1, "no mount with a wrong name hash");
+	inodes[0].name_hash ^= 1;
+	test_image_write(path, image, image_size);
+	unit_check(ufs_mount(path) == 0, "mount of the restored image");
+	unit_check(ufs_open("missing", 0) == -1, "missing file");
+	ufs_destroy();
+
+	unlink(path);
+	free(saved);
+	free(image);
+	free(data);
+	free(buf);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -448,12 +823,17 @@ main(void)
 
 	test_open();
 	test_close();
+	test_descriptor_reuse();
+	test_threads();
 	test_io();
+	test_pread_pwrite();
+	test_pread_view();
 	test_delete();
 	test_stress_open();
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_image();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
@@ -1,39 +1,80 @@
 #include "userfs.h"
+#include "image.h"
+#include "name_hash.h"
+#include "pool.h"
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
 enum {
-	BLOCK_SIZE = 512,
+	/** Size of the first extent of a file. */
+	EXTENT_MIN_SIZE = 4096,
+	/** Each next extent is twice bigger until this size. */
+	EXTENT_MAX_SIZE = 1024 * 1024,
+	/** Number of the first extent of the maximal size. */
+	EXTENT_MAX_INDEX = 8,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
-struct block {
-	/** Block memory. */
+/*
+ * Locks, in the order of taking:
+ * - file_names_lock - the namespace: file_names and file_list;
+ * - filedesc.lock - the position of the descriptor. It is changed
+ *   under this lock and the file lock, or by a resize of the file
+ *   under the exclusive file lock alone;
+ * - file.lock - the file content, size, refs, pins and descriptor list;
+ * - file_descriptors_lock - the descriptor table and free_fds;
+ * - pool_lock - all the pools.
+ * The namespace is locked exclusively only to create and delete
+ * files, and the files are read under shared locks. So I/O on
+ * different files, and reads of the same file, go in parallel.
+ */
+
+/**
+ * Contiguous chunk of a file. The size and the file offset of an
+ * extent depend only on its number: small files take little memory,
+ * big ones are a few large chunks, and the extent of any position is
+ * computed without a search.
+ */
+struct extent {
+	/** Extent memory, extent_size() bytes. */
 	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/** An extent cut off a pinned file, see ufs_pread_view(). */
+struct retired_extent {
+	char *memory;
+	/** Extent number, it tells the pool. */
+	int index;
 };
 
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
-	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
-	 */
-	struct block *last_block;
+	/** Array of file extents. All of them except the last are full. */
+	struct extent *extents;
+	int extent_count;
+	int extent_capacity;
+	/** File size, the last extent is filled up to it. */
+	size_t size;
+	/** Shared for reading the content, exclusive for changing it. */
+	pthread_rwlock_t lock;
 	/** How many file descriptors are opened on the file. */
 	int refs;
+	/**
+	 * How many views of the content are not released. The pinned
+	 * file is not deleted, and its truncated extents are retired
+	 * instead of freed, until the last view is released.
+	 */
+	int pins;
+	struct retired_extent *retired;
+	int retired_count;
+	int retired_capacity;
+	/** Double-linked list of the descriptors opened on the file. */
+	struct filedesc *descs;
 	/** File name. */
 	char *name;
 	/** Files are stored in a double-linked list. */
@@ -46,12 +87,48 @@ struct file {
 /** List of all files. */
 static struct file *file_list = NULL;
 
+/**
+ * Files by their names. The deleted files which are still opened are
+ * only in the list. Zero initialization is the same as
+ * name_hash_create().
+ */
+static struct name_hash file_names;
+static pthread_rwlock_t file_names_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * The image mounted by ufs_mount(). Its files get to file_names only
+ * when they are opened, so the mount does not depend on their number.
+ */
+static struct image mounted_image;
+/**
+ * Which image files are in the namespace already: opened, created
+ * anew or deleted. Under file_names_lock, like the namespace.
+ */
+static bool *mounted_image_is_taken = NULL;
+
 struct filedesc {
 	struct file *file;
 
 	/* PUT HERE OTHER MEMBERS */
 	int open_mode;
-	size_t pos;
+	/**
+	 * References of the table and of the running operations. The
+	 * descriptor is freed when the last one is gone, so a concurrent
+	 * close does not free it under an operation.
+	 */
+	int refs;
+	/** Serializes the operations sharing the descriptor position. */
+	pthread_mutex_t lock;
+	/**
+	 * Position as an extent number and an offset in it. The offset can
+	 * be the extent size, then the next I/O goes to the next extent. So
+	 * the sequential I/O stays in its extent without any computations.
+	 */
+	int extent;
+	size_t offset;
+	/** Descriptors of the same file. */
+	struct filedesc *next;
+	struct filedesc *prev;
 };
 
 /**
@@ -64,222 +141,698 @@ static struct filedesc **file_descriptors = NULL;
 static int file_descriptor_count = 0;
 static int file_descriptor_capacity = 0;
 
+/**
+ * Numbers of the closed descriptors, a min-heap. ufs_open() takes the
+ * lowest of them, like open() does, and extends the table only when
+ * there are none.
+ */
+static int *free_fds = NULL;
+static int free_fd_count = 0;
+static int free_fd_capacity = 0;
+static pthread_rwlock_t file_descriptors_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Files, descriptors and extents are allocated from pools. They are
+ * freed all at once in ufs_destroy(), except the extents of 64KB and
+ * bigger, which are freed right away. An extent pool per extent size,
+ * created on demand.
+ */
+static struct pool file_pool = {.object_size = sizeof(struct file)};
+static struct pool filedesc_pool = {.object_size = sizeof(struct filedesc)};
+static struct pool extent_pools[EXTENT_MAX_INDEX + 1];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
 enum ufs_error_code
 ufs_errno()
 {
 	return ufs_error_code;
 }
 
-int
-ufs_open(const char *filename, int flags)
+static size_t
+extent_size(int i)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	int fd = -1;
-	struct file * f = file_list;
-	while (f) {
-		if (f->name && strcmp(f->name, filename) == 0)
-			break;
-		f = f->next;
+	if (i < EXTENT_MAX_INDEX)
+		return (size_t)EXTENT_MIN_SIZE << i;
+	return EXTENT_MAX_SIZE;
+}
+
+/** File offset of the extent number @a i. */
+static size_t
+extent_start(int i)
+{
+	if (i < EXTENT_MAX_INDEX)
+		return ((size_t)EXTENT_MIN_SIZE << i) - EXTENT_MIN_SIZE;
+	return EXTENT_MAX_SIZE - EXTENT_MIN_SIZE +
+	       (size_t)(i - EXTENT_MAX_INDEX) * EXTENT_MAX_SIZE;
+}
+
+/** Number of the extent containing the file offset @a pos. */
+static int
+extent_index(size_t pos)
+{
+	size_t growth_end = extent_start(EXTENT_MAX_INDEX);
+	if (pos >= growth_end)
+		return EXTENT_MAX_INDEX + (pos - growth_end) / EXTENT_MAX_SIZE;
+	/* The start of extent i is MIN * (2^i - 1). */
+	return 63 - __builtin_clzll(pos / EXTENT_MIN_SIZE + 1);
+}
+
+/** Number of extents holding @a size bytes. */
+static int
+extent_count(size_t size)
+{
+	return size == 0 ? 0 : extent_index(size - 1) + 1;
+}
+
+static void *
+ufs_pool_alloc(struct pool *p)
+{
+	pthread_mutex_lock(&pool_lock);
+	void * ptr = pool_alloc(p);
+	pthread_mutex_unlock(&pool_lock);
+	return ptr;
+}
+
+static void
+ufs_pool_free(struct pool *p, void *ptr)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_free(p, ptr);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/** Must be called under pool_lock. */
+static struct pool *
+extent_pool(int i)
+{
+	struct pool * p = &extent_pools[i < EXTENT_MAX_INDEX ? i : EXTENT_MAX_INDEX];
+	if (p->object_size == 0)
+		pool_create(p, extent_size(i));
+	return p;
+}
+
+/**
+ * Must be called under pool_lock. The extents of the files of the
+ * mounted image are in its mapping, they are freed with it.
+ */
+static void
+extent_free(int i, char *memory)
+{
+	if (!image_contains(&mounted_image, memory))
+		pool_free(extent_pool(i), memory);
+}
+
+/** Append a new extent to the file, return its memory. */
+static char *
+file_add_extent(struct file *f)
+{
+	if (f->extent_count == f->extent_capacity) {
+		f->extent_capacity = f->extent_capacity == 0 ? 4 : f->extent_capacity * 2;
+		f->extents = (struct extent *) realloc(f->extents, f->extent_capacity * sizeof(struct extent));
 	}
-	if (flags == UFS_CREATE) flags = UFS_CREATE | UFS_READ_WRITE;
-	else if (flags == 0) flags = UFS_READ_WRITE;
-	if (!f) {
-		if (flags & UFS_CREATE) {
-			f = (struct file *) malloc(sizeof(struct file));
-			f->block_list = NULL;
-			f->last_block = NULL;
-			f->refs = 1;
-			f->name = (char *) malloc(strlen(filename)+1);
-			strcpy(f->name, filename);
-			f->next = file_list;
-			f->prev = NULL;
-			if (file_list)
-				file_list->prev = f;
-			file_list  = f;
-		} else {
-			ufs_error_code = UFS_ERR_NO_FILE;
-			return -1;
+	struct extent * e = &f->extents[f->extent_count];
+	pthread_mutex_lock(&pool_lock);
+	e->memory = (char *) pool_alloc(extent_pool(f->extent_count));
+	pthread_mutex_unlock(&pool_lock);
+	f->extent_count++;
+	return e->memory;
+}
+
+/** Delete the extents starting from @a count. */
+static void
+file_truncate_extents(struct file *f, int count)
+{
+	pthread_mutex_lock(&pool_lock);
+	while (f->extent_count > count) {
+		f->extent_count--;
+		char * memory = f->extents[f->extent_count].memory;
+		if (f->pins == 0) {
+			extent_free(f->extent_count, memory);
+			continue;
+		}
+		if (f->retired_count == f->retired_capacity) {
+			f->retired_capacity = f->retired_capacity == 0 ? 4 : f->retired_capacity * 2;
+			f->retired = (struct retired_extent *) realloc(f->retired, f->retired_capacity * sizeof(struct retired_extent));
 		}
-	} else {
-		f->refs++;
-		if (flags & UFS_CREATE) {
-			struct block * fb = f->block_list;
-			while (fb) {
-				f->block_list = fb->next;
-				free(fb->memory);
-				free(fb);
-				fb = f->block_list;
+		f->retired[f->retired_count].memory = memory;
+		f->retired[f->retired_count].index = f->extent_count;
+		f->retired_count++;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/** Free the extents retired while the file was pinned. */
+static void
+file_free_retired(struct file *f)
+{
+	pthread_mutex_lock(&pool_lock);
+	for (int i = 0; i < f->retired_count; i++)
+		extent_free(f->retired[i].index, f->retired[i].memory);
+	pthread_mutex_unlock(&pool_lock);
+	f->retired_count = 0;
+}
+
+/** Grow the file to @a new_size, the new bytes are zeros. */
+static void
+file_grow(struct file *f, size_t new_size)
+{
+	size_t pos = f->size;
+	while (f->extent_count < extent_count(new_size))
+		file_add_extent(f);
+	while (pos < new_size) {
+		int i = extent_index(pos);
+		size_t offset = pos - extent_start(i);
+		size_t len = extent_size(i) - offset;
+		if (len > new_size - pos)
+			len = new_size - pos;
+		memset(f->extents[i].memory + offset, 0, len);
+		pos += len;
+	}
+	f->size = new_size;
+}
+
+/**
+ * Copy the file content from @a pos to the buffers, one after another,
+ * until the buffers or the file end. Must be called under the file
+ * lock, shared or not.
+ */
+static size_t
+file_read_iov(const struct file *f, size_t pos, const struct iovec *iov, int iovcnt)
+{
+	if (pos >= f->size)
+		return 0;
+	size_t done = 0;
+	size_t left = f->size - pos;
+	int i = extent_index(pos);
+	size_t offset = pos - extent_start(i);
+	for (int v = 0; v < iovcnt && left > 0; v++) {
+		char * buf = (char *) iov[v].iov_base;
+		size_t size = iov[v].iov_len < left ? iov[v].iov_len : left;
+		size_t copied = 0;
+		while (copied < size) {
+			if (offset == extent_size(i)) {
+				i++;
+				offset = 0;
 			}
-			f->last_block = NULL;
+			size_t len = extent_size(i) - offset;
+			if (len > size - copied)
+				len = size - copied;
+			memcpy(buf + copied, f->extents[i].memory + offset, len);
+			copied += len;
+			offset += len;
 		}
+		done += size;
+		left -= size;
+	}
+	return done;
+}
+
+/** Total size of the buffers, or -1 if it is bigger than MAX_FILE_SIZE. */
+static ssize_t
+iov_size(const struct iovec *iov, int iovcnt)
+{
+	size_t size = 0;
+	for (int v = 0; v < iovcnt; v++) {
+		if (iov[v].iov_len > MAX_FILE_SIZE - size)
+			return -1;
+		size += iov[v].iov_len;
+	}
+	return size;
+}
+
+/**
+ * Copy the buffers to the file from @a pos, growing it if needed. A gap
+ * between the file end and @a pos is filled with zeros. The caller
+ * checks that the file fits MAX_FILE_SIZE. Must be called under the
+ * exclusive file lock.
+ */
+static size_t
+file_write_iov(struct file *f, size_t pos, const struct iovec *iov, int iovcnt)
+{
+	/* Like pwrite(2), writing nothing beyond the end leaves no gap. */
+	if (iov_size(iov, iovcnt) == 0)
+		return 0;
+	if (pos > f->size)
+		file_grow(f, pos);
+	size_t done = 0;
+	int i = extent_index(pos);
+	size_t offset = pos - extent_start(i);
+	for (int v = 0; v < iovcnt; v++) {
+		const char * buf = (const char *) iov[v].iov_base;
+		size_t size = iov[v].iov_len;
+		size_t copied = 0;
+		while (copied < size) {
+			if (offset == extent_size(i)) {
+				i++;
+				offset = 0;
+			}
+			/* The position is never beyond the end, so it is at most the next extent. */
+			char * memo = i < f->extent_count ? f->extents[i].memory : file_add_extent(f);
+			size_t len = extent_size(i) - offset;
+			if (len > size - copied)
+				len = size - copied;
+			memcpy(memo + offset, buf + copied, len);
+			copied += len;
+			offset += len;
+		}
+		done += size;
+	}
+	if (pos + done > f->size)
+		f->size = pos + done;
+	return done;
+}
+
+static size_t
+filedesc_pos(const struct filedesc *d)
+{
+	return extent_start(d->extent) + d->offset;
+}
+
+static void
+filedesc_set_pos(struct filedesc *d, size_t pos)
+{
+	d->extent = extent_index(pos);
+	d->offset = pos - extent_start(d->extent);
+}
+
+/** Move the descriptors behind the end of the file to the end. */
+static void
+file_clamp_descriptors(struct file *f)
+{
+	struct filedesc * d;
+	for (d = f->descs; d; d = d->next) {
+		if (filedesc_pos(d) > f->size)
+			filedesc_set_pos(d, f->size);
+	}
+}
+
+static void
+free_fds_push(int fd)
+{
+	if (free_fd_count == free_fd_capacity) {
+		free_fd_capacity = free_fd_capacity == 0 ? 16 : free_fd_capacity * 2;
+		free_fds = (int *) realloc(free_fds, free_fd_capacity * sizeof(int));
+	}
+	int i = free_fd_count++;
+	while (i > 0 && free_fds[(i - 1) / 2] > fd) {
+		free_fds[i] = free_fds[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	free_fds[i] = fd;
+}
+
+static int
+free_fds_pop(void)
+{
+	int fd = free_fds[0];
+	int last = free_fds[--free_fd_count];
+	int i = 0;
+	while (2 * i + 1 < free_fd_count) {
+		int child = 2 * i + 1;
+		if (child + 1 < free_fd_count && free_fds[child + 1] < free_fds[child])
+			child++;
+		if (last <= free_fds[child])
+			break;
+		free_fds[i] = free_fds[child];
+		i = child;
 	}
+	free_fds[i] = last;
+	return fd;
+}
+
+/** Take the lowest free descriptor number. */
+static int
+fd_alloc(void)
+{
+	if (free_fd_count > 0)
+		return free_fds_pop();
 	if (file_descriptor_count == file_descriptor_capacity) {
-		file_descriptor_capacity += 10;
+		file_descriptor_capacity = file_descriptor_capacity == 0 ? 16 : file_descriptor_capacity * 2;
 		file_descriptors = (struct filedesc **) realloc(file_descriptors, file_descriptor_capacity*sizeof(struct filedesc *));
 	}
-	fd = file_descriptor_count++;
-	file_descriptors[fd] = (struct filedesc *) malloc(sizeof(struct filedesc));
-	file_descriptors[fd]->file = f;
-	file_descriptors[fd]->open_mode = flags;
-	file_descriptors[fd]->pos = 0;
+	return file_descriptor_count++;
+}
 
-	ufs_error_code = UFS_ERR_NO_ERR;
-	return fd;
+/**
+ * Find the descriptor and take a reference to it, so a concurrent
+ * close does not free it until filedesc_put().
+ */
+static struct filedesc *
+filedesc_get(int fd)
+{
+	struct filedesc * d = NULL;
+	pthread_rwlock_rdlock(&file_descriptors_lock);
+	if (fd >= 0 && fd < file_descriptor_count)
+		d = file_descriptors[fd];
+	if (d)
+		__atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&file_descriptors_lock);
+	if (!d)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return d;
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+/** Must be called under the exclusive file_names_lock. */
+static void
+delete_file(struct file * f)
+{
+	free(f->name);
+	if (f->prev)
+		f->prev->next = f->next;
+	else
+		file_list = f->next;
+	if (f->next)
+		f->next->prev = f->prev;
+	file_truncate_extents(f, 0);
+	free(f->extents);
+	free(f->retired);
+	pthread_rwlock_destroy(&f->lock);
+	ufs_pool_free(&file_pool, f);
+}
+
+static void
+filedesc_put(struct filedesc *d)
+{
+	if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	struct file * f = d->file;
+	pthread_rwlock_wrlock(&f->lock);
+	if (d->prev)
+		d->prev->next = d->next;
+	else
+		f->descs = d->next;
+	if (d->next)
+		d->next->prev = d->prev;
+	f->refs--;
+	/* A deleted file can't be found, so nobody can open it again. */
+	bool is_garbage = f->name == NULL && f->refs == 0 && f->pins == 0;
+	pthread_rwlock_unlock(&f->lock);
+	pthread_mutex_destroy(&d->lock);
+	ufs_pool_free(&filedesc_pool, d);
+	if (is_garbage) {
+		pthread_rwlock_wrlock(&file_names_lock);
+		delete_file(f);
+		pthread_rwlock_unlock(&file_names_lock);
+	}
+}
+
+/** Must be called under the exclusive file_names_lock. */
+static struct file *
+file_new(const char *filename)
+{
+	struct file * f = (struct file *) ufs_pool_alloc(&file_pool);
+	f->extents = NULL;
+	f->extent_count = 0;
+	f->extent_capacity = 0;
+	f->size = 0;
+	pthread_rwlock_init(&f->lock, NULL);
+	f->refs = 0;
+	f->pins = 0;
+	f->retired = NULL;
+	f->retired_count = 0;
+	f->retired_capacity = 0;
+	f->descs = NULL;
+	f->name = (char *) malloc(strlen(filename)+1);
+	strcpy(f->name, filename);
+	name_hash_insert(&file_names, f->name, f);
+	f->next = file_list;
+	f->prev = NULL;
+	if (file_list)
+		file_list->prev = f;
+	file_list  = f;
+	return f;
+}
+
+/**
+ * Take the file of the mounted image to the namespace.
+ * @retval >= 0 Number of its inode.
+ * @retval -1 There is no such file, or it is taken already.
+ */
+static int
+image_take(const char *filename)
+{
+	int i = image_find(&mounted_image, filename);
+	if (i < 0 || mounted_image_is_taken[i])
+		return -1;
+	mounted_image_is_taken[i] = true;
+	return i;
+}
+
+/**
+ * Make a file of the mounted image, if it is not taken yet. Its
+ * extents are in the mapping, nothing is copied. Must be called under
+ * the exclusive file_names_lock.
+ */
+static struct file *
+file_new_from_image(const char *filename)
+{
+	int i = image_take(filename);
+	if (i < 0)
+		return NULL;
+	const struct image_inode * inode = &mounted_image.inodes[i];
+	char * data = image_inode_data(&mounted_image, inode);
+	struct file * f = file_new(filename);
+	int count = extent_count(inode->size);
+	f->extents = (struct extent *) malloc(count * sizeof(struct extent));
+	f->extent_capacity = count;
+	for (f->extent_count = 0; f->extent_count < count; f->extent_count++)
+		f->extents[f->extent_count].memory = data + extent_start(f->extent_count);
+	f->size = inode->size;
+	return f;
+}
+
+int
+ufs_open(const char *filename, int flags)
 {
 	/* IMPLEMENT THIS FUNCTION */
-	if (fd < 0 || fd >= file_descriptor_count || file_descriptors[fd] == NULL) {
+	int fd = -1;
+	bool is_new = false;
+	if (flags == UFS_CREATE) flags = UFS_CREATE | UFS_READ_WRITE;
+	else if (flags == 0) flags = UFS_READ_WRITE;
+	pthread_rwlock_rdlock(&file_names_lock);
+	struct file * f = (struct file *) name_hash_find(&file_names, filename);
+	if (!f && ((flags & UFS_CREATE) || mounted_image.map)) {
+		/* The file could be created while the lock is retaken. */
+		pthread_rwlock_unlock(&file_names_lock);
+		pthread_rwlock_wrlock(&file_names_lock);
+		f = (struct file *) name_hash_find(&file_names, filename);
+		if (!f)
+			f = file_new_from_image(filename);
+		if (!f && (flags & UFS_CREATE)) {
+			f = file_new(filename);
+			is_new = true;
+		}
+	}
+	if (!f) {
+		pthread_rwlock_unlock(&file_names_lock);
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
-	if ((file_descriptors[fd]->open_mode & UFS_WRITE_ONLY) == 0 &&
-		(file_descriptors[fd]->open_mode & UFS_READ_WRITE) == 0) {
+	struct filedesc * d = (struct filedesc *) ufs_pool_alloc(&filedesc_pool);
+	d->file = f;
+	d->open_mode = flags;
+	d->refs = 1;
+	pthread_mutex_init(&d->lock, NULL);
+	d->extent = 0;
+	d->offset = 0;
+	d->prev = NULL;
+	pthread_rwlock_wrlock(&f->lock);
+	f->refs++;
+	if ((flags & UFS_CREATE) && !is_new) {
+		file_truncate_extents(f, 0);
+		f->size = 0;
+		file_clamp_descriptors(f);
+	}
+	d->next = f->descs;
+	if (f->descs)
+		f->descs->prev = d;
+	f->descs = d;
+	pthread_rwlock_unlock(&f->lock);
+	pthread_rwlock_unlock(&file_names_lock);
+
+	pthread_rwlock_wrlock(&file_descriptors_lock);
+	fd = fd_alloc();
+	file_descriptors[fd] = d;
+	pthread_rwlock_unlock(&file_descriptors_lock);
+
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return fd;
+}
+
+/**
+ * Write the buffers from @a pos, or from the descriptor position if
+ * @a use_pos is true. Only the latter moves the position, and only it
+ * has to serialize with the other users of the descriptor.
+ */
+static ssize_t
+filedesc_writev(int fd, const struct iovec *iov, int iovcnt, bool use_pos, size_t pos)
+{
+	struct filedesc * d = filedesc_get(fd);
+	if (!d)
+		return -1;
+	if ((d->open_mode & UFS_WRITE_ONLY) == 0 &&
+		(d->open_mode & UFS_READ_WRITE) == 0) {
+		filedesc_put(d);
 		ufs_error_code = UFS_ERR_NO_PERMISSION;
 		return -1;
 	}
-	if (file_descriptors[fd]->pos + size > MAX_FILE_SIZE) {
+	ssize_t size = iov_size(iov, iovcnt);
+	struct file * f = d->file;
+	if (use_pos)
+		pthread_mutex_lock(&d->lock);
+	pthread_rwlock_wrlock(&f->lock);
+	if (use_pos)
+		pos = filedesc_pos(d);
+	if (size < 0 || pos > MAX_FILE_SIZE || pos + size > MAX_FILE_SIZE) {
+		pthread_rwlock_unlock(&f->lock);
+		if (use_pos)
+			pthread_mutex_unlock(&d->lock);
+		filedesc_put(d);
 		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
-	if (size > 0) {
-		size_t pos = file_descriptors[fd]->pos;
-		struct block * pfb = NULL;
-		struct block * fb = file_descriptors[fd]->file->block_list;
-		size_t nb = pos / BLOCK_SIZE;
-		while (nb--) {
-			pfb = fb;
-			fb = fb->next;
-		}
-		if (!fb) {
-			file_descriptors[fd]->file->last_block = (struct block *) malloc(sizeof(struct block));
-			file_descriptors[fd]->file->last_block->memory = (char *) malloc(BLOCK_SIZE);
-			file_descriptors[fd]->file->last_block->occupied = 0;
-			file_descriptors[fd]->file->last_block->next = NULL;
-			file_descriptors[fd]->file->last_block->prev = pfb;
-			fb = file_descriptors[fd]->file->last_block;
-			if (!pfb) {
-				file_descriptors[fd]->file->block_list = fb;
-			} else
-				pfb->next = fb;
-		}
-		int rest = pos % BLOCK_SIZE;
-		size_t write_cur, write_next;
-		char * memo = fb->memory;
-		int i;
-		if (rest + size > BLOCK_SIZE) {
-			write_cur = BLOCK_SIZE - rest;
-			write_next = rest + size - BLOCK_SIZE;
-		} else {
-			write_cur = size;
-			write_next = 0;
-		}
-		for (i = 0; write_cur; i++, rest++, write_cur--) {
-			memo[rest] = buf[i];
-		}
-		if (rest > fb->occupied)
-			fb->occupied = rest;
-		while (write_next) {
-			if (!fb->next) {
-				file_descriptors[fd]->file->last_block = (struct block *) malloc(sizeof(struct block));
-				file_descriptors[fd]->file->last_block->memory = (char *) malloc(BLOCK_SIZE);
-				file_descriptors[fd]->file->last_block->occupied = 0;
-				file_descriptors[fd]->file->last_block->next = NULL;
-				file_descriptors[fd]->file->last_block->prev = fb;
-				fb->next = file_descriptors[fd]->file->last_block;
-				fb = file_descriptors[fd]->file->last_block;
-			} else
-				fb = fb->next;
-			memo = fb->memory;
-			for (rest = 0; write_next && rest < BLOCK_SIZE; i++, rest++, write_next--) {
-				memo[rest] = buf[i];
-			}
-			if (rest > fb->occupied)
-				fb->occupied = rest;
-		}
+	file_write_iov(f, pos, iov, iovcnt);
+	if (use_pos)
+		filedesc_set_pos(d, pos + size);
+	pthread_rwlock_unlock(&f->lock);
+	if (use_pos)
+		pthread_mutex_unlock(&d->lock);
+	filedesc_put(d);
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return size;
+}
+
+/** Read to the buffers, the same way as filedesc_writev() writes. */
+static ssize_t
+filedesc_readv(int fd, const struct iovec *iov, int iovcnt, bool use_pos, size_t pos)
+{
+	struct filedesc * d = filedesc_get(fd);
+	if (!d)
+		return -1;
+	if ((d->open_mode & UFS_READ_ONLY) == 0 &&
+		(d->open_mode & UFS_READ_WRITE) == 0) {
+		filedesc_put(d);
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
 	}
-	file_descriptors[fd]->pos += size;
+	struct file * f = d->file;
+	if (use_pos)
+		pthread_mutex_lock(&d->lock);
+	pthread_rwlock_rdlock(&f->lock);
+	if (use_pos)
+		pos = filedesc_pos(d);
+	size_t size = file_read_iov(f, pos, iov, iovcnt);
+	if (use_pos)
+		filedesc_set_pos(d, pos + size);
+	pthread_rwlock_unlock(&f->lock);
+	if (use_pos)
+		pthread_mutex_unlock(&d->lock);
+	filedesc_put(d);
 	ufs_error_code = UFS_ERR_NO_ERR;
 	return size;
 }
 
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+	/* IMPLEMENT THIS FUNCTION */
+	struct iovec iov = {(void *) buf, size};
+	return filedesc_writev(fd, &iov, 1, true, 0);
+}
+
 ssize_t
 ufs_read(int fd, char *buf, size_t size)
 {
 	/* IMPLEMENT THIS FUNCTION */
-	int i = 0;
-	if (fd < 0 || fd >= file_descriptor_count || file_descriptors[fd] == NULL) {
-		ufs_error_code = UFS_ERR_NO_FILE;
+	struct iovec iov = {buf, size};
+	return filedesc_readv(fd, &iov, 1, true, 0);
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	struct iovec iov = {(void *) buf, size};
+	return filedesc_writev(fd, &iov, 1, false, offset);
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	struct iovec iov = {buf, size};
+	return filedesc_readv(fd, &iov, 1, false, offset);
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return filedesc_writev(fd, iov, iovcnt, true, 0);
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return filedesc_readv(fd, iov, iovcnt, true, 0);
+}
+
+ssize_t
+ufs_pread_view(int fd, size_t offset, size_t size, struct iovec *iov, int *iovcnt,
+	       struct ufs_pin **pin)
+{
+	struct filedesc * d = filedesc_get(fd);
+	if (!d)
 		return -1;
-	}
-	if ((file_descriptors[fd]->open_mode & UFS_READ_ONLY) == 0 &&
-		(file_descriptors[fd]->open_mode & UFS_READ_WRITE) == 0) {
+	if ((d->open_mode & UFS_READ_ONLY) == 0 &&
+		(d->open_mode & UFS_READ_WRITE) == 0) {
+		filedesc_put(d);
 		ufs_error_code = UFS_ERR_NO_PERMISSION;
 		return -1;
 	}
-	if (size > 0) {
-		struct block * _fb = file_descriptors[fd]->file->block_list;
-		size_t cur_length = 0;
-		while (_fb) {
-			cur_length += _fb->occupied;
-			_fb = _fb->next;
-		}
-		size_t pos = file_descriptors[fd]->pos;
-		if (pos + size > cur_length) {
-			size = cur_length - pos;
-		}
-		if (size > 0) {
-			struct block * fb = file_descriptors[fd]->file->block_list;
-			size_t nb = pos / BLOCK_SIZE;
-			size_t ns = pos % BLOCK_SIZE;
-			while (nb--) {
-				fb = fb->next;
-			}
-			size_t read_cur, read_next;
-			char * memo = fb->memory;
-			if (ns + size > BLOCK_SIZE) {
-				read_cur = BLOCK_SIZE - ns;
-				read_next = ns + size - BLOCK_SIZE;
-			} else {
-				read_cur = size;
-				read_next = 0;
-			}
-			for (i = 0; read_cur; i++, ns++, read_cur--) {
-				buf[i] = memo[ns];
-			}
-			while (read_next) {
-				fb = fb->next;
-				memo = fb->memory;
-				for (ns = 0; read_next && ns < BLOCK_SIZE; i++, ns++, read_next--) {
-					buf[i] = memo[ns];
-				}
-			}
+	struct file * f = d->file;
+	size_t done = 0;
+	int count = 0;
+	pthread_rwlock_rdlock(&f->lock);
+	if (offset < f->size) {
+		if (size > f->size - offset)
+			size = f->size - offset;
+		int i = extent_index(offset);
+		size_t extent_offset = offset - extent_start(i);
+		while (done < size && count < *iovcnt) {
+			size_t len = extent_size(i) - extent_offset;
+			if (len > size - done)
+				len = size - done;
+			iov[count].iov_base = f->extents[i].memory + extent_offset;
+			iov[count].iov_len = len;
+			count++;
+			done += len;
+			i++;
+			extent_offset = 0;
 		}
 	}
-	file_descriptors[fd]->pos += i;
+	/* The readers pin concurrently, the unpins are under the exclusive lock. */
+	__atomic_add_fetch(&f->pins, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&f->lock);
+	filedesc_put(d);
+	*iovcnt = count;
+	/* The pin is the file itself, the type only hides it. */
+	*pin = (struct ufs_pin *) f;
 	ufs_error_code = UFS_ERR_NO_ERR;
-	return i;
+	return done;
 }
 
-void delete_file(struct file * f) {
-	if (f) {
-		free(f->name);
-		if (f->prev)
-			f->prev->next = f->next;
-		else
-			file_list = f->next;
-		if (f->next)
-			f->next->prev = f->prev;
-		struct block * fb = f->block_list;
-		while (fb) {
-			f->block_list = fb->next;
-			free(fb->memory);
-			free(fb);
-			fb = f->block_list;
-		}
-		free(f);
+void
+ufs_unpin(struct ufs_pin *pin)
+{
+	struct file * f = (struct file *) pin;
+	pthread_rwlock_wrlock(&f->lock);
+	f->pins--;
+	if (f->pins == 0 && f->retired_count > 0)
+		file_free_retired(f);
+	bool is_garbage = f->name == NULL && f->refs == 0 && f->pins == 0;
+	pthread_rwlock_unlock(&f->lock);
+	if (is_garbage) {
+		pthread_rwlock_wrlock(&file_names_lock);
+		delete_file(f);
+		pthread_rwlock_unlock(&file_names_lock);
 	}
 }
 
@@ -287,15 +840,21 @@ int
 ufs_close(int fd)
 {
 	/* IMPLEMENT THIS FUNCTION */
-	if (fd < 0 || fd >= file_descriptor_count || file_descriptors[fd] == NULL) {
+	struct filedesc * d = NULL;
+	pthread_rwlock_wrlock(&file_descriptors_lock);
+	if (fd >= 0 && fd < file_descriptor_count)
+		d = file_descriptors[fd];
+	if (d) {
+		file_descriptors[fd] = NULL;
+		free_fds_push(fd);
+	}
+	pthread_rwlock_unlock(&file_descriptors_lock);
+	if (!d) {
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
-	file_descriptors[fd]->file->refs--;
-	if (file_descriptors[fd]->file->name == NULL && file_descriptors[fd]->file->refs == 0)
-		delete_file(file_descriptors[fd]->file);
-	free(file_descriptors[fd]);
-	file_descriptors[fd] = NULL;
+	/* The running operations on the descriptor keep it alive. */
+	filedesc_put(d);
 
 	ufs_error_code = UFS_ERR_NO_ERR;
 	return 0;
@@ -305,21 +864,25 @@ int
 ufs_delete(const char *filename)
 {
 	/* IMPLEMENT THIS FUNCTION */
-	struct file * f = file_list;
-	while (f) {
-		if (f->name && strcmp(f->name, filename) == 0)
-			break;
-		f = f->next;
-	}
+	pthread_rwlock_wrlock(&file_names_lock);
+	struct file * f = (struct file *) name_hash_remove(&file_names, filename);
 	if (!f) {
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		/* A file of the image which was never opened is only marked. */
+		int rc = image_take(filename) >= 0 ? 0 : -1;
+		pthread_rwlock_unlock(&file_names_lock);
+		ufs_error_code = rc == 0 ? UFS_ERR_NO_ERR : UFS_ERR_NO_FILE;
+		return rc;
 	}
-	if (f->refs > 0) {
+	pthread_rwlock_wrlock(&f->lock);
+	bool is_opened = f->refs > 0 || f->pins > 0;
+	if (is_opened) {
 		free(f->name);
 		f->name = NULL;
-	} else
+	}
+	pthread_rwlock_unlock(&f->lock);
+	if (!is_opened)
 		delete_file(f);
+	pthread_rwlock_unlock(&file_names_lock);
 	ufs_error_code = UFS_ERR_NO_ERR;
 	return 0;
 }
@@ -327,84 +890,169 @@ ufs_delete(const char *filename)
 void
 ufs_destroy(void)
 {
-	while (file_list)
-		delete_file(file_list);
+	/* The files, descriptors and extents are freed with their pools. */
+	struct file * f;
+	for (f = file_list; f; f = f->next) {
+		free(f->name);
+		free(f->extents);
+		free(f->retired);
+		pthread_rwlock_destroy(&f->lock);
+	}
+	file_list = NULL;
 	int i;
-	for (i = 0; i < file_descriptor_count; i++)
-		free(file_descriptors[i]);
+	for (i = 0; i < file_descriptor_count; i++) {
+		if (file_descriptors[i])
+			pthread_mutex_destroy(&file_descriptors[i]->lock);
+	}
+	pool_destroy(&file_pool);
+	pool_destroy(&filedesc_pool);
+	for (i = 0; i <= EXTENT_MAX_INDEX; i++)
+		pool_destroy(&extent_pools[i]);
+	name_hash_destroy(&file_names);
+	name_hash_create(&file_names);
 	free(file_descriptors);
+	file_descriptors = NULL;
+	file_descriptor_count = 0;
+	file_descriptor_capacity = 0;
+	free(free_fds);
+	free_fds = NULL;
+	free_fd_count = 0;
+	free_fd_capacity = 0;
+	image_unmap(&mounted_image);
+	free(mounted_image_is_taken);
+	mounted_image_is_taken = NULL;
 }
 
 int
-ufs_resize(int fd, size_t new_size) {
-	if (fd < 0 || fd >= file_descriptor_count || file_descriptors[fd] == NULL) {
-		ufs_error_code = UFS_ERR_NO_FILE;
+ufs_snapshot(const char *path)
+{
+	/*
+	 * The locks are held until the data is written, so it is one
+	 * moment of all the files. The sync goes without them.
+	 */
+	pthread_rwlock_rdlock(&file_names_lock);
+	uint32_t count = 0;
+	int extent_total = 0;
+	struct file * f;
+	for (f = file_list; f; f = f->next) {
+		if (!f->name)
+			continue;
+		pthread_rwlock_rdlock(&f->lock);
+		count++;
+		extent_total += extent_count(f->size);
+	}
+	uint32_t i;
+	uint32_t image_count = mounted_image.map ? mounted_image.super->file_count : 0;
+	for (i = 0; i < image_count; i++) {
+		if (!mounted_image_is_taken[i])
+			count++;
+	}
+	struct image_file * files = (struct image_file *) malloc(count * sizeof(struct image_file));
+	/* An extra piece per image file. */
+	struct iovec * data = (struct iovec *) malloc((extent_total + image_count) * sizeof(struct iovec));
+	struct image_file * file = files;
+	struct iovec * piece = data;
+	for (f = file_list; f; f = f->next) {
+		if (!f->name)
+			continue;
+		int n = extent_count(f->size);
+		file->name = f->name;
+		file->size = f->size;
+		file->reserve = extent_start(n);
+		file->data = piece;
+		file->data_count = n;
+		for (int j = 0; j < n; j++, piece++) {
+			piece->iov_base = f->extents[j].memory;
+			piece->iov_len = j < n - 1 ? extent_size(j) : f->size - extent_start(j);
+		}
+		file++;
+	}
+	for (i = 0; i < image_count; i++) {
+		if (mounted_image_is_taken[i])
+			continue;
+		const struct image_inode * inode = &mounted_image.inodes[i];
+		file->name = image_inode_name(&mounted_image, inode);
+		file->size = inode->size;
+		file->reserve = inode->data_reserve;
+		file->data = piece;
+		file->data_count = 1;
+		piece->iov_base = image_inode_data(&mounted_image, inode);
+		piece->iov_len = inode->size;
+		piece++;
+		file++;
+	}
+	struct image_writer writer;
+	int rc = image_write(&writer, path, files, count);
+	for (f = file_list; f; f = f->next) {
+		if (f->name)
+			pthread_rwlock_unlock(&f->lock);
+	}
+	pthread_rwlock_unlock(&file_names_lock);
+	free(files);
+	free(data);
+	if (rc == 0)
+		rc = image_commit(&writer);
+	ufs_error_code = rc == 0 ? UFS_ERR_NO_ERR : UFS_ERR_IMAGE;
+	return rc;
+}
+
+int
+ufs_mount(const char *path)
+{
+	pthread_rwlock_wrlock(&file_names_lock);
+	if (file_list || mounted_image.map || image_map(&mounted_image, path) != 0) {
+		pthread_rwlock_unlock(&file_names_lock);
+		ufs_error_code = UFS_ERR_IMAGE;
 		return -1;
 	}
-	int mode = file_descriptors[fd]->open_mode;
+	/* The image is valid, but the files must also fit the extents. */
+	uint32_t count = mounted_image.super->file_count;
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		const struct image_inode * inode = &mounted_image.inodes[i];
+		if (inode->size > MAX_FILE_SIZE ||
+		    inode->data_reserve < extent_start(extent_count(inode->size)))
+			break;
+	}
+	if (i < count) {
+		image_unmap(&mounted_image);
+		pthread_rwlock_unlock(&file_names_lock);
+		ufs_error_code = UFS_ERR_IMAGE;
+		return -1;
+	}
+	mounted_image_is_taken = (bool *) calloc(count, sizeof(bool));
+	pthread_rwlock_unlock(&file_names_lock);
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return 0;
+}
+
+int
+ufs_resize(int fd, size_t new_size) {
+	struct filedesc * d = filedesc_get(fd);
+	if (!d)
+		return -1;
+	int mode = d->open_mode;
 	if ((mode & UFS_WRITE_ONLY) == 0 && (mode & UFS_READ_WRITE) == 0) {
+		filedesc_put(d);
 		ufs_error_code = UFS_ERR_NO_PERMISSION;
 		return -1;
 	}
 	if (new_size > MAX_FILE_SIZE) {
+		filedesc_put(d);
 		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
-	struct block * fb = file_descriptors[fd]->file->block_list;
-	size_t cur_length = 0;
-	while (fb) {
-		cur_length += fb->occupied;
-		fb = fb->next;
-	}
-	if (cur_length < new_size) {
-		int now = cur_length / BLOCK_SIZE;
-		int must = new_size / BLOCK_SIZE;
-		if (file_descriptors[fd]->file->block_list == NULL) {
-			file_descriptors[fd]->file->block_list =
-				file_descriptors[fd]->file->last_block =
-					(struct block *) malloc(sizeof(struct block));
-			file_descriptors[fd]->file->block_list->memory = (char *) malloc(BLOCK_SIZE);
-			file_descriptors[fd]->file->block_list->occupied = 0;
-			file_descriptors[fd]->file->block_list->next = NULL;
-			file_descriptors[fd]->file->block_list->prev = NULL;
-		}
-		size_t rest = new_size % BLOCK_SIZE;
-		file_descriptors[fd]->file->last_block->occupied = BLOCK_SIZE;
-		while (now < must) {
-			fb = (struct block *) malloc(sizeof(struct block));
-			fb->memory = (char *) malloc(BLOCK_SIZE);
-			fb->occupied = BLOCK_SIZE;
-			fb->prev = file_descriptors[fd]->file->last_block;
-			file_descriptors[fd]->file->last_block->next = fb;
-			file_descriptors[fd]->file->last_block = fb;
-			fb->next = NULL;
-			now++;
-		}
-		file_descriptors[fd]->file->last_block->occupied = rest;
-	} else if (cur_length > new_size) {
-		fb = file_descriptors[fd]->file->block_list;
-		size_t cur_length = 0;
-		while (fb && cur_length + fb->occupied < new_size) {
-			cur_length += fb->occupied;
-			fb = fb->next;
-		}
-		fb->occupied = new_size - cur_length;
-		file_descriptors[fd]->file->last_block = fb;
-		fb = fb->next;
-		file_descriptors[fd]->file->last_block->next = NULL;
-		while (fb) {
-			free(fb->memory);
-			struct block * next = fb->next;
-			free(fb);
-			fb = next;
-		}
-		int i;
-		for (i = 0; i < file_descriptor_count; i++)
-			if (file_descriptors[i] && file_descriptors[i]->file == file_descriptors[fd]->file
-				&& file_descriptors[i]->pos > new_size) {
-				file_descriptors[i]->pos = new_size;
-			}
+	struct file * f = d->file;
+	pthread_rwlock_wrlock(&f->lock);
+	if (f->size < new_size) {
+		file_grow(f, new_size);
+	} else if (f->size > new_size) {
+		file_truncate_extents(f, extent_count(new_size));
+		f->size = new_size;
+		file_clamp_descriptors(f);
 	}
+	pthread_rwlock_unlock(&f->lock);
+	filedesc_put(d);
 	ufs_error_code = UFS_ERR_NO_ERR;
 	return 0;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
@@ -65,9 +66,14 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	/** An image can't be read, written or mounted. */
+	UFS_ERR_IMAGE,
 };
 
-/** Get code of the last error. */
+/**
+ * Get code of the last error of the calling thread. All the functions
+ * can be called from many threads at once, except ufs_destroy().
+ */
 enum ufs_error_code
 ufs_errno();
 
@@ -112,6 +118,70 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file from @a offset. Unlike ufs_write(), the
+ * descriptor position is not used nor changed, so the concurrent
+ * users of one descriptor don't wait for each other. If @a offset is
+ * beyond the file end, the gap is filled with zeros.
+ *
+ * @retval > 0 How many bytes were written.
+ * @retval -1 Error occurred. The same codes as of ufs_write().
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file from @a offset. Like ufs_pwrite(), it does
+ * not use nor change the descriptor position.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. The same codes as of ufs_read().
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write @a iovcnt buffers one after another, like one ufs_write() of
+ * all of them together.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read to @a iovcnt buffers, filling them one by one, like one
+ * ufs_read() to all of them together.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Reference to a file content, which keeps it in memory. */
+struct ufs_pin;
+
+/**
+ * Get the file content from @a offset, up to @a size bytes, without
+ * copying: as spans of the file memory in @a iov. The content of one
+ * extent is one span, so if @a iovcnt spans are not enough, the rest
+ * is not returned, like in a short read. The spans must not be
+ * written to. They stay valid until ufs_unpin(), even if the file is
+ * truncated or deleted meanwhile. Writes to the range are seen in the
+ * spans, and a concurrent one can be seen partially.
+ *
+ * @param iovcnt Size of @a iov, and the number of spans on return.
+ * @param pin The reference to pass to ufs_unpin(). It is returned on
+ *        success, even if there are no spans.
+ *
+ * @retval >= 0 How many bytes the spans hold. 0 means EOF.
+ * @retval -1 Error occurred. The same codes as of ufs_read().
+ */
+ssize_t
+ufs_pread_view(int fd, size_t offset, size_t size, struct iovec *iov, int *iovcnt,
+	       struct ufs_pin **pin);
+
+/** Release the spans returned by ufs_pread_view(). */
+void
+ufs_unpin(struct ufs_pin *pin);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -162,10 +232,39 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Save all the files to an image at @a path, to be mounted by
+ * ufs_mount() later, usually by another process. The deleted files
+ * which are still opened are not saved. The files are not changed
+ * while they are written, so the image is of one moment. They are
+ * released before the image is synced to the disk.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred.
+ *     - UFS_ERR_IMAGE - the image can't be written, errno tells why.
+ */
+int
+ufs_snapshot(const char *path);
+
+/**
+ * Mount an image saved by ufs_snapshot(). The files of the image become
+ * the files of the FS. Their content is not read: it is mapped, and
+ * the reads go right to the mapping. The changes of the files are
+ * not saved to the image, only a new snapshot saves them.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred.
+ *     - UFS_ERR_IMAGE - the image can't be read, is not valid, or the
+ *       FS is not empty. Only one image can be mounted.
+ */
+int
+ufs_mount(const char *path);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * The mounted image is unmapped too.
  */
 void
 ufs_destroy(void);
@@ -0,0 +1,517 @@
+#include "userfs.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Usage: userfs_bench [io [size_mb] | write [size_mb] | names [max_count] |
+ *                      threads [max_threads] | image [count]]
+ * Without arguments all the benchmarks are run with default sizes.
+ *
+ * io - write a file of size_mb megabytes (100 by default, the maximal
+ *     file size) with 4KB writes and read it back the same way. Then
+ *     do 4KB reads and writes through a few descriptors at random
+ *     depths of the file, and with pread and pwrite at random offsets.
+ *     Then read the file by 16 records of 256 bytes with readv, and by
+ *     4KB zero-copy views.
+ * write - write a file of size_mb megabytes (100 by default) with the
+ *     operations of 1KB to 1MB, rewrite it in place, read it.
+ * names - create, open and delete 1000 files, then 10 times more and
+ *     so on up to max_count (1000000 by default). Besides the average
+ *     time the longest single operation is reported.
+ * threads - 1, 2, 4 and so on up to max_threads (32 by default) threads
+ *     do 4KB reads and writes, each on its own file, and then all on
+ *     one shared file through own descriptors. The total speed is
+ *     reported, it can grow with the threads only as long as there
+ *     are free CPUs.
+ * image - create count files (10000 by default) of 1 - 16KB, save them
+ *     to an image in the current directory, mount it and read all the
+ *     files. Loading the same files with ufs_write() is for comparison.
+ */
+
+enum {
+	BENCH_IO_SIZE = 4096,
+	/** Descriptors for the random I/O. */
+	BENCH_IO_FD_COUNT = 8,
+	/** Records in one vectored read. */
+	BENCH_IOV_COUNT = 16,
+	/** File size of a thread, so the threads don't lose on memory. */
+	BENCH_THREAD_FILE_SIZE = 1024 * 1024,
+	/** Operations of each thread. */
+	BENCH_THREAD_OPS = 200 * 1000,
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void
+bench_report(const char *name, uint64_t ops, uint64_t bytes, double sec)
+{
+	printf("%-24s %10.3f ms %12.0f ops/s %10.1f MB/s\n", name, sec * 1000,
+	       ops / sec, bytes / sec / 1024 / 1024);
+}
+
+/** Time of a series of operations, with the slowest one. */
+struct bench_timer {
+	double start;
+	double last;
+	double max;
+};
+
+static void
+bench_timer_start(struct bench_timer *t)
+{
+	t->start = bench_now();
+	t->last = t->start;
+	t->max = 0;
+}
+
+static void
+bench_timer_tick(struct bench_timer *t)
+{
+	double now = bench_now();
+	if (now - t->last > t->max)
+		t->max = now - t->last;
+	t->last = now;
+}
+
+static void
+bench_timer_report(const struct bench_timer *t, const char *name,
+		   uint64_t ops)
+{
+	double sec = t->last - t->start;
+	printf("%-24s %10.3f ms %12.0f ops/s %10.1f us max\n", name,
+	       sec * 1000, ops / sec, t->max * 1000000);
+}
+
+static void
+bench_names(uint32_t count)
+{
+	char name[32];
+	struct bench_timer t;
+	bench_timer_start(&t);
+	for (uint32_t i = 0; i < count; ++i) {
+		sprintf(name, "file%u", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		assert(fd >= 0);
+		ufs_close(fd);
+		bench_timer_tick(&t);
+	}
+	bench_timer_report(&t, "create", count);
+
+	bench_timer_start(&t);
+	for (uint32_t i = 0; i < count; ++i) {
+		sprintf(name, "file%u", i * 7919 % count);
+		int fd = ufs_open(name, 0);
+		assert(fd >= 0);
+		ufs_close(fd);
+		bench_timer_tick(&t);
+	}
+	bench_timer_report(&t, "open", count);
+
+	bench_timer_start(&t);
+	for (uint32_t i = 0; i < count; ++i) {
+		sprintf(name, "missing%u", i);
+		int fd = ufs_open(name, 0);
+		assert(fd < 0);
+		(void)fd;
+		bench_timer_tick(&t);
+	}
+	bench_timer_report(&t, "open missing", count);
+
+	bench_timer_start(&t);
+	for (uint32_t i = 0; i < count; ++i) {
+		sprintf(name, "file%u", i);
+		int rc = ufs_delete(name);
+		assert(rc == 0);
+		(void)rc;
+		bench_timer_tick(&t);
+	}
+	bench_timer_report(&t, "delete", count);
+}
+
+static void
+bench_io(uint64_t size)
+{
+	char buf[BENCH_IO_SIZE];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i * 7 % 26;
+	uint64_t count = size / sizeof(buf);
+
+	int fd = ufs_open("bench", UFS_CREATE);
+	assert(fd >= 0);
+	double start = bench_now();
+	for (uint64_t i = 0; i < count; ++i) {
+		ssize_t rc = ufs_write(fd, buf, sizeof(buf));
+		assert(rc == sizeof(buf));
+		(void)rc;
+	}
+	bench_report("sequential write", count, count * sizeof(buf),
+		     bench_now() - start);
+	ufs_close(fd);
+
+	fd = ufs_open("bench", 0);
+	assert(fd >= 0);
+	start = bench_now();
+	for (uint64_t i = 0; i < count; ++i) {
+		ssize_t rc = ufs_read(fd, buf, sizeof(buf));
+		assert(rc == sizeof(buf));
+		(void)rc;
+	}
+	bench_report("sequential read", count, count * sizeof(buf),
+		     bench_now() - start);
+	ufs_close(fd);
+
+	/*
+	 * There is no seek, so the descriptors are spread over the file by
+	 * reading, and then each operation goes to a random one of them.
+	 */
+	srand(1);
+	int fds[BENCH_IO_FD_COUNT];
+	for (int i = 0; i < BENCH_IO_FD_COUNT; ++i) {
+		fds[i] = ufs_open("bench", 0);
+		assert(fds[i] >= 0);
+		uint64_t skip = count * i / BENCH_IO_FD_COUNT;
+		for (uint64_t j = 0; j < skip; ++j)
+			ufs_read(fds[i], buf, sizeof(buf));
+	}
+	start = bench_now();
+	for (uint64_t i = 0; i < count; ++i) {
+		int *fd = &fds[rand() % BENCH_IO_FD_COUNT];
+		ssize_t rc;
+		if (rand() % 2 == 0)
+			rc = ufs_read(*fd, buf, sizeof(buf));
+		else
+			rc = ufs_write(*fd, buf, sizeof(buf));
+		if (rc < (ssize_t)sizeof(buf)) {
+			/* The end of the file, start over. */
+			ufs_close(*fd);
+			*fd = ufs_open("bench", 0);
+		}
+	}
+	bench_report("random read/write", count, count * sizeof(buf),
+		     bench_now() - start);
+	for (int i = 0; i < BENCH_IO_FD_COUNT; ++i)
+		ufs_close(fds[i]);
+
+	fd = ufs_open("bench", 0);
+	assert(fd >= 0);
+	start = bench_now();
+	for (uint64_t i = 0; i < count; ++i) {
+		size_t offset = (uint64_t)rand() * rand() % (size - sizeof(buf));
+		ssize_t rc = ufs_pread(fd, buf, sizeof(buf), offset);
+		assert(rc == sizeof(buf));
+		(void)rc;
+	}
+	bench_report("random pread", count, count * sizeof(buf),
+		     bench_now() - start);
+	start = bench_now();
+	for (uint64_t i = 0; i < count; ++i) {
+		size_t offset = (uint64_t)rand() * rand() % (size - sizeof(buf));
+		ssize_t rc = ufs_pwrite(fd, buf, sizeof(buf), offset);
+		assert(rc == sizeof(buf));
+		(void)rc;
+	}
+	bench_report("random pwrite", count, count * sizeof(buf),
+		     bench_now() - start);
+	ufs_close(fd);
+
+	/* The same sequential read, but to many small records at once. */
+	struct iovec iov[BENCH_IOV_COUNT];
+	char records[BENCH_IOV_COUNT][BENCH_IO_SIZE / BENCH_IOV_COUNT];
+	for (int i = 0; i < BENCH_IOV_COUNT; ++i) {
+		iov[i].iov_base = records[i];
+		iov[i].iov_len = sizeof(records[i]);
+	}
+	fd = ufs_open("bench", 0);
+	assert(fd >= 0);
+	start = bench_now();
+	for (uint64_t i = 0; i < count; ++i) {
+		ssize_t rc = ufs_readv(fd, iov, BENCH_IOV_COUNT);
+		assert(rc == sizeof(records));
+		(void)rc;
+	}
+	bench_report("sequential readv", count, count * sizeof(records),
+		     bench_now() - start);
+
+	/* The views are not copied, only their first bytes are touched. */
+	uint64_t sum = 0;
+	start = bench_now();
+	for (uint64_t i = 0; i < count; ++i) {
+		int iovcnt = BENCH_IOV_COUNT;
+		struct ufs_pin *pin;
+		ssize_t rc = ufs_pread_view(fd, i * sizeof(buf), sizeof(buf),
+					    iov, &iovcnt, &pin);
+		assert(rc == sizeof(buf));
+		(void)rc;
+		for (int j = 0; j < iovcnt; ++j)
+			sum += *(char *)iov[j].iov_base;
+		ufs_unpin(pin);
+	}
+	bench_report("sequential view", count, count * sizeof(buf),
+		     bench_now() - start);
+	assert(sum > 0);
+	ufs_close(fd);
+	ufs_delete("bench");
+}
+
+static void
+bench_write(uint64_t size)
+{
+	const size_t max_op_size = 1024 * 1024;
+	char *buf = malloc(max_op_size);
+	for (size_t i = 0; i < max_op_size; ++i)
+		buf[i] = 'a' + i * 7 % 26;
+	for (size_t op_size = 1024; op_size <= max_op_size; op_size *= 4) {
+		char name[64];
+		uint64_t count = size / op_size;
+		uint64_t bytes = count * op_size;
+		int fd = ufs_open("bench", UFS_CREATE);
+		assert(fd >= 0);
+		double start = bench_now();
+		for (uint64_t i = 0; i < count; ++i) {
+			ssize_t rc = ufs_write(fd, buf, op_size);
+			assert(rc == (ssize_t)op_size);
+			(void)rc;
+		}
+		sprintf(name, "write by %zu", op_size);
+		bench_report(name, count, bytes, bench_now() - start);
+		ufs_close(fd);
+
+		fd = ufs_open("bench", 0);
+		start = bench_now();
+		for (uint64_t i = 0; i < count; ++i)
+			ufs_write(fd, buf, op_size);
+		sprintf(name, "rewrite by %zu", op_size);
+		bench_report(name, count, bytes, bench_now() - start);
+		ufs_close(fd);
+
+		fd = ufs_open("bench", 0);
+		start = bench_now();
+		for (uint64_t i = 0; i < count; ++i)
+			ufs_read(fd, buf, op_size);
+		sprintf(name, "read by %zu", op_size);
+		bench_report(name, count, bytes, bench_now() - start);
+		ufs_close(fd);
+		ufs_delete("bench");
+	}
+	free(buf);
+}
+
+struct bench_thread {
+	pthread_t thread;
+	const char *name;
+	/** Every how many reads there is a write. */
+	int write_step;
+};
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_thread *t = arg;
+	char buf[BENCH_IO_SIZE];
+	memset(buf, 'a', sizeof(buf));
+	int fd = ufs_open(t->name, 0);
+	assert(fd >= 0);
+	uint64_t pos = 0;
+	for (int i = 0; i < BENCH_THREAD_OPS; ++i) {
+		if (pos == BENCH_THREAD_FILE_SIZE) {
+			ufs_close(fd);
+			fd = ufs_open(t->name, 0);
+			pos = 0;
+		}
+		ssize_t rc;
+		if (i % t->write_step == 0)
+			rc = ufs_write(fd, buf, sizeof(buf));
+		else
+			rc = ufs_read(fd, buf, sizeof(buf));
+		assert(rc == sizeof(buf));
+		(void)rc;
+		pos += sizeof(buf);
+	}
+	ufs_close(fd);
+	return NULL;
+}
+
+/**
+ * Run the threads on the files, which are created and filled here. The
+ * threads sharing a file go in a row.
+ */
+static void
+bench_threads_run(struct bench_thread *threads, int count, const char *name)
+{
+	char *buf = calloc(1, BENCH_THREAD_FILE_SIZE);
+	for (int i = 0; i < count; ++i) {
+		if (i > 0 && threads[i].name == threads[i - 1].name)
+			continue;
+		int fd = ufs_open(threads[i].name, UFS_CREATE);
+		assert(fd >= 0);
+		ufs_write(fd, buf, BENCH_THREAD_FILE_SIZE);
+		ufs_close(fd);
+	}
+	free(buf);
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		int rc = pthread_create(&threads[i].thread, NULL,
+					bench_thread_f, &threads[i]);
+		assert(rc == 0);
+		(void)rc;
+	}
+	for (int i = 0; i < count; ++i)
+		pthread_join(threads[i].thread, NULL);
+	uint64_t ops = (uint64_t)count * BENCH_THREAD_OPS;
+	bench_report(name, ops, ops * BENCH_IO_SIZE, bench_now() - start);
+	for (int i = 0; i < count; ++i) {
+		if (i == 0 || threads[i].name != threads[i - 1].name)
+			ufs_delete(threads[i].name);
+	}
+}
+
+static void
+bench_threads(int count)
+{
+	struct bench_thread *threads = calloc(count, sizeof(*threads));
+	char (*names)[16] = calloc(count, sizeof(*names));
+	const int write_steps[] = {1000 * 1000 * 1000, 10, 1};
+	const char *step_names[] = {"read", "10% write", "write"};
+	for (size_t s = 0; s < sizeof(write_steps) / sizeof(write_steps[0]);
+	     ++s) {
+		char name[64];
+		for (int i = 0; i < count; ++i) {
+			sprintf(names[i], "bench%d", i);
+			threads[i].name = names[i];
+			threads[i].write_step = write_steps[s];
+		}
+		sprintf(name, "own files %s", step_names[s]);
+		bench_threads_run(threads, count, name);
+		for (int i = 0; i < count; ++i)
+			threads[i].name = "bench";
+		sprintf(name, "shared file %s", step_names[s]);
+		bench_threads_run(threads, count, name);
+	}
+	free(names);
+	free(threads);
+}
+
+static void
+bench_image(uint32_t count)
+{
+	enum { MAX_SIZE = 16 * 1024 };
+	const char *path = "userfs_bench.ufs";
+	char buf[MAX_SIZE];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i * 7 % 26;
+	uint32_t *sizes = malloc(count * sizeof(*sizes));
+	uint64_t bytes = 0;
+	srand(1);
+	for (uint32_t i = 0; i < count; ++i) {
+		sizes[i] = 1 + rand() % MAX_SIZE;
+		bytes += sizes[i];
+	}
+	char name[32];
+	double start = bench_now();
+	for (uint32_t i = 0; i < count; ++i) {
+		sprintf(name, "file%u", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		ssize_t rc = ufs_write(fd, buf, sizes[i]);
+		assert(rc == sizes[i]);
+		(void)rc;
+		ufs_close(fd);
+	}
+	bench_report("load by write", count, bytes, bench_now() - start);
+
+	start = bench_now();
+	int rc = ufs_snapshot(path);
+	assert(rc == 0);
+	bench_report("snapshot", count, bytes, bench_now() - start);
+	ufs_destroy();
+
+	start = bench_now();
+	rc = ufs_mount(path);
+	assert(rc == 0);
+	(void)rc;
+	bench_report("mount", count, bytes, bench_now() - start);
+	start = bench_now();
+	for (uint32_t i = 0; i < count; ++i) {
+		sprintf(name, "file%u", i);
+		int fd = ufs_open(name, 0);
+		ssize_t rc = ufs_read(fd, buf, sizeof(buf));
+		assert(rc == sizes[i]);
+		(void)rc;
+		ufs_close(fd);
+	}
+	bench_report("first read", count, bytes, bench_now() - start);
+	start = bench_now();
+	for (uint32_t i = 0; i < count; ++i) {
+		sprintf(name, "file%u", i);
+		int fd = ufs_open(name, 0);
+		ufs_read(fd, buf, sizeof(buf));
+		ufs_close(fd);
+	}
+	bench_report("second read", count, bytes, bench_now() - start);
+	ufs_destroy();
+	unlink(path);
+	free(sizes);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *mode = argc > 1 ? argv[1] : NULL;
+	if (mode == NULL || strcmp(mode, "io") == 0) {
+		uint64_t size = 100;
+		if (mode != NULL && argc > 2)
+			size = atoi(argv[2]);
+		size *= 1024 * 1024;
+		printf("# %llu MB file, %d byte operations\n",
+		       (unsigned long long)size >> 20, BENCH_IO_SIZE);
+		bench_io(size);
+	}
+	if (mode == NULL || strcmp(mode, "write") == 0) {
+		uint64_t size = 100;
+		if (mode != NULL && argc > 2)
+			size = atoi(argv[2]);
+		size *= 1024 * 1024;
+		printf("# %llu MB file\n", (unsigned long long)size >> 20);
+		bench_write(size);
+	}
+	if (mode == NULL || strcmp(mode, "names") == 0) {
+		uint32_t max_count = 1000 * 1000;
+		if (mode != NULL && argc > 2)
+			max_count = atoi(argv[2]);
+		for (uint32_t count = 1000; count <= max_count; count *= 10) {
+			printf("# %u files\n", count);
+			bench_names(count);
+		}
+	}
+	if (mode == NULL || strcmp(mode, "threads") == 0) {
+		int max_threads = 32;
+		if (mode != NULL && argc > 2)
+			max_threads = atoi(argv[2]);
+		for (int count = 1; count <= max_threads; count *= 2) {
+			printf("# %d threads, %d byte operations\n", count,
+			       BENCH_IO_SIZE);
+			bench_threads(count);
+		}
+	}
+	if (mode == NULL || strcmp(mode, "image") == 0) {
+		uint32_t count = 10 * 1000;
+		if (mode != NULL && argc > 2)
+			count = atoi(argv[2]);
+		printf("# %u files\n", count);
+		bench_image(count);
+	}
+	ufs_destroy();
+	return 0;
+}
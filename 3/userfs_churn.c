@@ -0,0 +1,88 @@
+#include "userfs.h"
+
+#include "heap_help/heap_help.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Usage: userfs_churn [iterations [live_count]]
+ *
+ * Keep live_count (100 by default) files and replace them one by one
+ * for the given number of iterations (200000 by default): delete a
+ * file, create it again, write 1 - 16KB, read it back through a second
+ * descriptor, close both. It is a metadata heavy workload, where the
+ * allocations matter more than the copying.
+ *
+ * The allocations are counted by heap_help. Its bookkeeping is a part
+ * of the measured time, and its free() is linear in the number of live
+ * allocations. So the speed is comparable only between the runs of
+ * this benchmark with the same live_count.
+ */
+
+static double
+churn_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t iterations = 200 * 1000;
+	uint32_t live_count = 100;
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (argc > 2)
+		live_count = atoi(argv[2]);
+	if (live_count == 0)
+		live_count = 1;
+	enum { MAX_WRITE = 16 * 1024 };
+	char *data = malloc(MAX_WRITE);
+	char *buf = malloc(MAX_WRITE);
+	for (int i = 0; i < MAX_WRITE; ++i)
+		data[i] = 'a' + i * 7 % 26;
+	srand(1);
+	uint64_t live = heaph_get_alloc_count();
+	uint64_t total = heaph_get_alloc_count_total();
+	double start = churn_now();
+	for (uint32_t i = 0; i < iterations; ++i) {
+		char name[32];
+		sprintf(name, "file%u", i % live_count);
+		if (i >= live_count)
+			ufs_delete(name);
+		int out = ufs_open(name, UFS_CREATE);
+		int in = ufs_open(name, UFS_READ_ONLY);
+		assert(out >= 0 && in >= 0);
+		size_t size = 1 + rand() % MAX_WRITE;
+		ssize_t rc = ufs_write(out, data, size);
+		assert(rc == (ssize_t)size);
+		rc = ufs_read(in, buf, MAX_WRITE);
+		assert(rc == (ssize_t)size && memcmp(buf, data, size) == 0);
+		(void)rc;
+		ufs_close(in);
+		ufs_close(out);
+	}
+	double sec = churn_now() - start;
+	uint64_t allocs = heaph_get_alloc_count_total() - total;
+	printf("%u iterations, %u live files\n", iterations, live_count);
+	printf("%10.3f ms %12.0f iterations/s %8.2f allocations/iteration\n",
+	       sec * 1000, iterations / sec, (double)allocs / iterations);
+	printf("%llu allocations are live\n",
+	       (unsigned long long)(heaph_get_alloc_count() - live));
+
+	start = churn_now();
+	ufs_destroy();
+	printf("destroy %.3f ms, %llu allocations are left\n",
+	       (churn_now() - start) * 1000,
+	       (unsigned long long)(heaph_get_alloc_count() - live));
+	free(data);
+	free(buf);
+	return 0;
+}
@@ -4,3 +4,7 @@
 
 uint64_t
 heaph_get_alloc_count(void);
+
+/** Number of allocations ever made, including the freed ones. */
+uint64_t
+heaph_get_alloc_count_total(void);